@@ -0,0 +1,289 @@
+/********************************************************************
+ * ** Program Filename: bench/ftmicro.c
+ * ** Description: Microbenchmarks for ftserver.c's hot paths. The
+ *      server is compiled into this program (its main() renamed), so
+ *      the functions measured are exactly the ones the server runs:
+ *          inDir       file name lookup, hit on the last entry and miss
+ *          sendDir     directory listing serialization
+ *          dispatch    control message parsing in handleRequest()
+ *          splitArgs   splitting a server-side command into words
+ *          sendFile    the file copy loop
+ *      Socket output goes to an in-memory sink (a memfd rewound before
+ *      every operation), so no network or client is involved.
+ * ** Input: Options:
+ *          -n list     directory sizes, comma separated
+ *                      (default 10,100,1000,10000)
+ *          -s list     file sizes, comma separated, k/m/g suffixes
+ *                      allowed (default 4k,64k,1m,16m)
+ *          -t seconds  minimum time per measurement (default 0.5)
+ *          -b name     run only the named benchmark
+ * ** Output: One JSON object per line on stdout, one line per
+ *      benchmark and parameter, e.g.
+ *      {"bench":"inDir","case":"hit","files":1000,"iters":4000,
+ *       "ns_per_op":61234.5}
+ *      sendFile lines also carry "bytes" and "mb_per_s". The server's
+ *      own progress messages are discarded.
+ * ** Build: gcc -O2 -o ftmicro bench/ftmicro.c
+ * *********************************************************************/
+
+#define main ftserverMain
+#include "../ftserver.c"
+#undef main
+
+#define MAX_SIZES 32
+
+//One measurement: op() is called with arg until minSeconds pass
+struct benchResult {
+    long long iters;
+    double nsPerOp;
+};
+
+double minSeconds = 0.5;
+int sinkFD; //In-memory stand-in for the data connection
+FILE *results; //Where result lines go; stdout itself is silenced
+const char *only = NULL;
+
+
+
+/*********************************************************************
+ * ** Function: rewindSink()
+ * ** Description: Empties the sink so it never grows past one
+ *      operation's output.
+ * ** Parameters: None
+ * ** Pre-Conditions: sinkFD must be open.
+ * ** Post-Conditions: The sink is empty and positioned at 0.
+ * *********************************************************************/
+void rewindSink(){
+    if(ftruncate(sinkFD, 0) < 0 || lseek(sinkFD, 0, SEEK_SET) < 0)
+        error("ERROR rewinding sink");
+}
+
+
+
+/*********************************************************************
+ * ** Function: runBench()
+ * ** Description: Calls op(arg) in doubling batches until a batch
+ *      takes at least minSeconds, then reports that batch. A warm-up
+ *      call runs first so the page cache and dentry cache are hot.
+ * ** Parameters: The operation, its argument.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the iteration count and ns per call.
+ * *********************************************************************/
+struct benchResult runBench(void (*op)(void *), void *arg){
+    struct benchResult r;
+    long long n = 1, i, start, elapsed;
+
+    op(arg);
+    while(1){
+        start = nowUsec();
+        for(i = 0; i < n; i++)
+            op(arg);
+        elapsed = nowUsec() - start;
+        if(elapsed >= minSeconds * 1e6 || n >= (1LL << 40))
+            break;
+        n *= 2;
+    }
+    r.iters = n;
+    r.nsPerOp = elapsed * 1000.0 / n;
+    return r;
+}
+
+
+
+/*********************************************************************
+ * ** Function: wanted()
+ * ** Description: Checks a benchmark name against -b.
+ * ** Parameters: The benchmark name.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns true if the benchmark should run.
+ * *********************************************************************/
+int wanted(const char *name){
+    return only == NULL || strcmp(only, name) == 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: fillDir()
+ * ** Description: Makes a fresh directory holding count empty files
+ *      named f0000000, f0000001, ... and changes into it.
+ * ** Parameters: The scratch directory to create it under, the
+ *      number of files.
+ * ** Pre-Conditions: The scratch directory must exist.
+ * ** Post-Conditions: The current directory is the new one.
+ * *********************************************************************/
+void fillDir(const char *scratch, int count){
+    char path[PATH_MAX], name[32];
+    int i, fd;
+
+    snprintf(path, sizeof(path), "%s/dir%d", scratch, count);
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) error("ERROR creating directory");
+    if(chdir(path) < 0) error("ERROR entering directory");
+    for(i = 0; i < count; i++){
+        snprintf(name, sizeof(name), "f%07d", i);
+        fd = open(name, O_WRONLY | O_CREAT, 0644);
+        if(fd < 0) error("ERROR creating file");
+        close(fd);
+    }
+}
+
+
+
+//The operations being measured
+void opInDir(void *arg){
+    if(inDir(arg) < 0) error("ERROR in inDir");
+}
+
+void opSendDir(void *arg){
+    (void) arg;
+    rewindSink();
+    sendDir(sinkFD, 0);
+}
+
+void opDispatch(void *arg){
+    char buffer[BUFFER_SIZE];
+
+    //Takes every branch test in handleRequest() and ends in "unk"
+    memset(buffer, 0, sizeof(buffer));
+    strcpy(buffer, arg);
+    rewindSink();
+    handleRequest(buffer, sinkFD, 0);
+}
+
+void opSplitArgs(void *arg){
+    char buffer[BUFFER_SIZE], *args[MAX_ARGS];
+
+    strcpy(buffer, arg);
+    if(splitArgs(buffer, args, MAX_ARGS) == 0) error("ERROR in splitArgs");
+}
+
+void opSendFile(void *arg){
+    rewindSink();
+    sendFile(arg, 0, sinkFD, 0);
+}
+
+
+
+/*********************************************************************
+ * ** Function: parseList()
+ * ** Description: Parses a comma separated list of sizes.
+ * ** Parameters: The list, an array for the values, its length.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the number of values, or exits on a bad
+ *      list.
+ * *********************************************************************/
+int parseList(char *list, long long *values, int max){
+    int count = 0;
+    char *item;
+
+    for(item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")){
+        if(count == max) error("ERROR, too many sizes");
+        values[count] = parseSize(item);
+        if(values[count] <= 0){
+            fprintf(stderr, "ERROR, bad size \"%s\".\n", item);
+            exit(1);
+        }
+        count++;
+    }
+    return count;
+}
+
+
+
+/*MAIN*/
+int main(int argc, char *argv[]){
+    long long dirSizes[MAX_SIZES] = { 10, 100, 1000, 10000 };
+    long long fileSizes[MAX_SIZES] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20 };
+    int numDirs = 4, numFiles = 4, i, opt;
+    char scratch[] = "/tmp/ftmicro.XXXXXX", name[32], *chunk;
+    struct benchResult r;
+
+    while((opt = getopt(argc, argv, "n:s:t:b:")) != -1){
+        switch(opt){
+            case 'n': numDirs = parseList(optarg, dirSizes, MAX_SIZES); break;
+            case 's': numFiles = parseList(optarg, fileSizes, MAX_SIZES); break;
+            case 't': minSeconds = atof(optarg); break;
+            case 'b': only = optarg; break;
+            default:
+                fprintf(stderr, "usage: ftmicro [-n dirSizes] [-s fileSizes] [-t seconds]"
+                        " [-b inDir|sendDir|dispatch|splitArgs|sendFile]\n");
+                exit(1);
+        }
+    }
+
+    //Keep result lines, drop the server's progress messages
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if(results == NULL || freopen("/dev/null", "w", stdout) == NULL)
+        error("ERROR redirecting output");
+    sinkFD = memfd_create("ftmicro-sink", 0);
+    if(sinkFD < 0) error("ERROR creating sink");
+    if(mkdtemp(scratch) == NULL) error("ERROR creating scratch directory");
+    initMetrics();
+
+    //Lookup and listing, by directory size
+    for(i = 0; i < numDirs; i++){
+        fillDir(scratch, dirSizes[i]);
+        snprintf(name, sizeof(name), "f%07lld", dirSizes[i] - 1);
+        if(wanted("inDir")){
+            r = runBench(opInDir, name);
+            fprintf(results, "{\"bench\":\"inDir\",\"case\":\"hit\",\"files\":%lld,"
+                    "\"iters\":%lld,\"ns_per_op\":%.1f}\n", dirSizes[i], r.iters, r.nsPerOp);
+            r = runBench(opInDir, "missing.txt");
+            fprintf(results, "{\"bench\":\"inDir\",\"case\":\"miss\",\"files\":%lld,"
+                    "\"iters\":%lld,\"ns_per_op\":%.1f}\n", dirSizes[i], r.iters, r.nsPerOp);
+        }
+        if(wanted("sendDir")){
+            r = runBench(opSendDir, NULL);
+            fprintf(results, "{\"bench\":\"sendDir\",\"files\":%lld,"
+                    "\"iters\":%lld,\"ns_per_op\":%.1f}\n", dirSizes[i], r.iters, r.nsPerOp);
+        }
+        fflush(results);
+    }
+
+    //Parsing does not depend on the directory
+    if(wanted("dispatch")){
+        r = runBench(opDispatch, "\%none");
+        fprintf(results, "{\"bench\":\"dispatch\",\"case\":\"unknown\","
+                "\"iters\":%lld,\"ns_per_op\":%.1f}\n", r.iters, r.nsPerOp);
+    }
+    if(wanted("splitArgs")){
+        r = runBench(opSplitArgs, "-cat joined.txt part1.txt part2.txt part3.txt part4.txt");
+        fprintf(results, "{\"bench\":\"splitArgs\",\"case\":\"cat4\","
+                "\"iters\":%lld,\"ns_per_op\":%.1f}\n", r.iters, r.nsPerOp);
+    }
+    fflush(results);
+
+    //File copy loop, by file size
+    if(wanted("sendFile")){
+        if(chdir(scratch) < 0) error("ERROR entering scratch directory");
+        chunk = malloc(RECV_CHUNK);
+        memset(chunk, 'x', RECV_CHUNK);
+        for(i = 0; i < numFiles; i++){
+            long long left = fileSizes[i];
+            int fd;
+
+            snprintf(name, sizeof(name), "file%lld", fileSizes[i]);
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0) error("ERROR creating file");
+            while(left > 0){
+                int n = write(fd, chunk, left < RECV_CHUNK ? left : RECV_CHUNK);
+                if(n < 0) error("ERROR writing file");
+                left -= n;
+            }
+            close(fd);
+            r = runBench(opSendFile, name);
+            fprintf(results, "{\"bench\":\"sendFile\",\"bytes\":%lld,\"iters\":%lld,"
+                    "\"ns_per_op\":%.1f,\"mb_per_s\":%.1f}\n", fileSizes[i], r.iters,
+                    r.nsPerOp, fileSizes[i] / r.nsPerOp * 1e3);
+            fflush(results);
+            unlink(name);
+        }
+        free(chunk);
+    }
+
+    //Clean up the scratch tree
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", scratch);
+    if(system(cmd) != 0) error("ERROR removing scratch directory");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# Soak test: drives mixed traffic at ftserver for a long time and
+# samples its resident memory, open file descriptors and allocator
+# stats (from "-metrics"). Fails if any of them grew by more than its
+# threshold between the first sample after warm-up and the last one,
+# or if the server died.
+#
+# Besides the ftload mix, every sample period also sends requests
+# that fail early: a client that hangs up before sending its data
+# port, and one whose data port nobody is listening on.
+#
+# usage: bench/soak.sh
+# environment:
+#   DURATION      seconds to run (default 3600)
+#   SAMPLE        seconds between samples (default 60)
+#   WARMUP        samples taken before the baseline (default 1)
+#   MAX_RSS_KB    allowed RSS growth in KiB (default 4096)
+#   MAX_FDS       allowed open fd growth (default 4)
+#   MAX_HEAP      allowed heap_in_use growth in bytes (default 1048576)
+#   PORT, CONNS, SAMPLES_CSV (where samples go, default soak.csv)
+#
+set -e
+cd "$(dirname "$0")/.."
+REPO=$(pwd)
+PORT=${PORT:-48000}
+CONNS=${CONNS:-4}
+DURATION=${DURATION:-3600}
+SAMPLE=${SAMPLE:-60}
+WARMUP=${WARMUP:-1}
+MAX_RSS_KB=${MAX_RSS_KB:-4096}
+MAX_FDS=${MAX_FDS:-4}
+MAX_HEAP=${MAX_HEAP:-1048576}
+SAMPLES_CSV=${SAMPLES_CSV:-soak.csv}
+WORK=$(mktemp -d)
+server=
+load=
+trap 'status=$?; kill $server $load 2>/dev/null || true; rm -rf "$WORK"; exit $status' EXIT
+
+gcc -O2 -o "$WORK/ftserver" ftserver.c
+gcc -O2 -o "$WORK/ftload" ftload.c
+
+#Files to serve
+mkdir -p "$WORK/srv"
+echo "small file" > "$WORK/srv/small.txt"
+head -c 1048576 /dev/urandom > "$WORK/srv/large.bin"
+(cd "$WORK/srv" && exec "$WORK/ftserver" "$PORT" > /dev/null 2>&1) &
+server=$!
+sleep 0.5
+
+"$WORK/ftload" -c "$CONNS" -d "$DURATION" -m 4:small.txt -m 2:-l -m 1:large.bin \
+    -m 1:missing.txt -m "1:-s small.txt" -m 1:-metrics -m 1:%none \
+    localhost "$PORT" > "$WORK/load.log" &
+load=$!
+
+#Requests that end early, to exercise the server's error paths
+badClients(){
+    python3 - "$PORT" <<'EOF'
+import socket, sys
+port = int(sys.argv[1])
+#Hangs up after the command
+s = socket.create_connection(("localhost", port))
+s.sendall(b"small.txt".ljust(500, b"\0"))
+s.close()
+#Data port with no listener
+s = socket.create_connection(("localhost", port))
+s.sendall(b"small.txt".ljust(500, b"\0") + b"1".ljust(500, b"\0"))
+s.recv(1)
+s.close()
+EOF
+}
+
+#heap_in_use from the server's metrics
+heapInUse(){
+    (cd "$WORK" && python3 "$REPO/ftclient.py" localhost "$PORT" -M $((PORT + 1 + $1 % 1000))) \
+        | awk '$1 == "heap_in_use" { print $2 }'
+}
+
+echo "time,rss_kb,fds,heap_in_use" > "$SAMPLES_CSV"
+start=$(date +%s)
+i=0
+while kill -0 "$load" 2>/dev/null; do
+    sleep "$SAMPLE"
+    if ! kill -0 "$server" 2>/dev/null; then
+        echo "FAIL: ftserver exited" >&2
+        exit 1
+    fi
+    badClients 2>/dev/null || true
+    rss=$(awk '$1 == "VmRSS:" { print $2 }' "/proc/$server/status")
+    fds=$(ls "/proc/$server/fd" | wc -l)
+    heap=$(heapInUse "$i")
+    echo "$(( $(date +%s) - start )),$rss,$fds,$heap" | tee -a "$SAMPLES_CSV"
+    i=$((i + 1))
+done
+wait "$load" || true
+cat "$WORK/load.log"
+
+#Compare the last sample with the baseline
+awk -F, -v warmup="$WARMUP" -v maxRss="$MAX_RSS_KB" -v maxFds="$MAX_FDS" -v maxHeap="$MAX_HEAP" '
+    NR == 1 { next }
+    NR == warmup + 2 { rss = $2; fds = $3; heap = $4 }
+    { last = $0; lastRss = $2; lastFds = $3; lastHeap = $4 }
+    END {
+        if(rss == ""){ print "FAIL: run too short for a baseline"; exit 1 }
+        printf("growth: rss %d KiB, fds %d, heap %d bytes\n", lastRss - rss, lastFds - fds, lastHeap - heap)
+        bad = 0
+        if(lastRss - rss > maxRss){ print "FAIL: RSS grew"; bad = 1 }
+        if(lastFds - fds > maxFds){ print "FAIL: open fds grew"; bad = 1 }
+        if(lastHeap - heap > maxHeap){ print "FAIL: heap grew"; bad = 1 }
+        if(!bad) print "PASS"
+        exit bad
+    }' "$SAMPLES_CSV"
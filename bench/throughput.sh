@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Throughput workload: serves a small directory with the given ftserver
+# binary and drives it with ftload for a fixed time, then stops the
+# server with SIGTERM so instrumented builds write their profiles.
+# Used both to train the PGO build and to compare builds
+# (see the Makefile's pgo and compare targets). Before stopping, it
+# checks that the ftclient.py library downloads large.bin intact.
+#
+# usage: bench/throughput.sh ftserver-binary [ftload-binary]
+# environment: PORT (default 49000), SECONDS_PER_RUN (default 20),
+#   CONNS (default 4)
+#
+set -e
+cd "$(dirname "$0")/.."
+SERVER=$(realpath "$1")
+LOAD=$(realpath "${2:-ftload}")
+PORT=${PORT:-49000}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-20}
+CONNS=${CONNS:-4}
+WORK=$(mktemp -d)
+server=
+trap 'status=$?; kill $server 2>/dev/null || true; rm -rf "$WORK"; exit $status' EXIT
+
+#Files to serve: many small ones for listings and a few sizes to send
+mkdir "$WORK/srv"
+i=0
+while [ $i -lt 200 ]; do
+    echo "file $i" > "$WORK/srv/small$i.txt"
+    i=$((i + 1))
+done
+head -c 65536 /dev/urandom > "$WORK/srv/medium.bin"
+head -c 8388608 /dev/urandom > "$WORK/srv/large.bin"
+(cd "$WORK/srv" && exec "$SERVER" "$PORT" > /dev/null 2>&1) &
+server=$!
+sleep 0.5
+if ! kill -0 "$server" 2>/dev/null; then
+    echo "ftserver failed to start on port $PORT" >&2
+    exit 1
+fi
+
+"$LOAD" -c "$CONNS" -d "$SECONDS_PER_RUN" -m 4:small7.txt -m 2:-l -m 2:medium.bin \
+    -m 1:large.bin -m "1:-s medium.bin" -m 1:missing.txt -m "1:-probe 64m" \
+    localhost "$PORT"
+
+#Library round trip of a multi-MB file, both to disk and to memory
+(export PYTHONPATH="$(pwd)" && cd "$WORK" && python3 -c "
+import ftclient
+with ftclient.Client('localhost', $PORT, timeout=5) as c:
+    c.get('large.bin', 'large.copy')
+    open('large.buffer', 'wb').write(c.getBuffer('large.bin'))
+")
+cmp "$WORK/srv/large.bin" "$WORK/large.copy"
+cmp "$WORK/srv/large.bin" "$WORK/large.buffer"
+
+#Let the server leave main() normally
+kill -TERM "$server"
+wait "$server" || true
+server=
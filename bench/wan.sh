@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# WAN scenarios: runs ftload (and one ftclient.py download) against
+# ftserver through ftproxy under several emulated network conditions.
+# Both the control and the data connections go through the proxy.
+#
+# usage: bench/wan.sh [scenario ...]
+#   scenarios: lan wan lossy thin (default: all)
+# environment: PORT (base port, default 47000), SECONDS_PER_RUN,
+#   CONNS
+#
+set -e
+cd "$(dirname "$0")/.."
+REPO=$(pwd)
+PORT=${PORT:-47000}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+CONNS=${CONNS:-4}
+WORK=$(mktemp -d)
+server=
+trap 'kill $server 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+gcc -O2 -o "$WORK/ftserver" ftserver.c
+gcc -O2 -o "$WORK/ftload" ftload.c
+gcc -O2 -o "$WORK/ftproxy" ftproxy.c
+
+#Files to serve: a small one and a 4 MB one
+mkdir -p "$WORK/srv" "$WORK/cli"
+echo "small file" > "$WORK/srv/small.txt"
+head -c 4194304 /dev/urandom > "$WORK/srv/large.bin"
+(cd "$WORK/srv" && exec "$WORK/ftserver" "$PORT" > "$WORK/server.log" 2>&1) &
+server=$!
+sleep 0.5
+
+#name: ftproxy options
+scenario(){
+    case "$1" in
+        lan) echo "-d 0.1" ;;
+        wan) echo "-d 40 -j 5 -b 12M" ;;
+        lossy) echo "-d 40 -j 10 -b 12M -p 0.02 -s 200" ;;
+        thin) echo "-d 150 -j 20 -b 1M" ;;
+        *) echo "unknown scenario $1" >&2; exit 1 ;;
+    esac
+}
+
+N=1
+for name in ${@:-lan wan lossy thin}; do
+    opts=$(scenario "$name")
+    proxyPort=$((PORT + N))
+    "$WORK/ftproxy" $opts "$proxyPort" localhost "$PORT" > "$WORK/proxy-$name.log" 2>&1 &
+    proxy=$!
+    sleep 0.3
+
+    echo "== $name ($opts)"
+    "$WORK/ftload" -c "$CONNS" -d "$SECONDS_PER_RUN" -m 2:-l -m 2:small.txt -m 1:large.bin \
+        localhost "$proxyPort" || true
+    start=$(date +%s.%N)
+    (cd "$WORK/cli" && rm -f large.bin \
+        && python3 "$REPO/ftclient.py" localhost "$proxyPort" -g large.bin $((PORT + 100 + N)) > /dev/null)
+    end=$(date +%s.%N)
+    echo "ftclient.py large.bin: $(awk "BEGIN { print $end - $start }") s"
+
+    kill "$proxy"
+    wait "$proxy" 2>/dev/null || true
+    N=$((N + 1))
+done
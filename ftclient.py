@@ -6,6 +6,12 @@
             port number
     Output: Receives directory listing or .txt file transfer from
             ftserver.c
+    Library: Importing this module gives Client (and AsyncClient), which
+            keep a pool of data listeners per server so programs can make
+            many requests without a process or new listener per request:
+                with ftclient.Client("host", 30020) as c:
+                    names = c.list()
+                    data = c.getBuffer("notes.txt")
     Sources Cited: This program relies heavily on the TCP client example
             provided in "Computer Networking: A Top-Down Approach, 7th ed."
             by J. Kurose and K. Ross
@@ -13,6 +19,14 @@
 from socket import *
 import argparse #For argument parsing
 import os #For interacting with current directory
+import time #For timing probe and sink transfers
+import asyncio #For running many requests at once (-G)
+import threading #For the -W disk writer thread
+import select #For waiting on sockets with a timeout while splicing
+import queue as queues
+
+#Size of every control message; matches BUFFER_SIZE in ftserver.c
+MSG_SIZE = 500
 
 def main():
     #Get server name, server port number, command,
@@ -22,7 +36,24 @@ def main():
     parser.add_argument('servPort', nargs=1, default=0, type=int, help='Server\'s port number.')
     parser.add_argument('-l', dest='listDir', action='store_true', default=False, help='Request dir listing.')
     parser.add_argument('-g', dest='fileName', default="%none", type=str, help='Request file transfer. Takes file name arg.')
-    parser.add_argument('dataPort', nargs=1, default=0, type=str, help='Data connection port num. Must be valid.')
+    parser.add_argument('-c', dest='copy', nargs=2, metavar=('SRC', 'DST'), help='Copy a file on the server.')
+    parser.add_argument('-m', dest='move', nargs=2, metavar=('SRC', 'DST'), help='Move (rename) a file on the server.')
+    parser.add_argument('-a', dest='concat', nargs='+', metavar='FILE', help='Concatenate files on the server: DST SRC [SRC ...]. Give after dataPort, if any.')
+    parser.add_argument('-M', dest='metrics', action='store_true', default=False, help='Request the server\'s metrics.')
+    parser.add_argument('-p', dest='probe', metavar='BYTES', help='Have the server stream BYTES of generated data (k/m/g suffixes allowed) and report throughput.')
+    parser.add_argument('-k', dest='sink', metavar='BYTES', help='Upload BYTES of generated data to the server, which discards it, and report throughput.')
+    parser.add_argument('-t', dest='push', nargs=3, metavar=('FILE', 'DESTHOST', 'DESTPORT'), help='Send a file straight from this server to the ftserver at DESTHOST:DESTPORT.')
+    parser.add_argument('-S', dest='statMany', nargs='+', metavar='FILE', help='Get the type, size and mtime of several files in one request. Give after dataPort, if any.')
+    parser.add_argument('-T', dest='top', nargs=2, metavar=('KEY', 'N'), help='List the N largest (KEY size) or most recently modified (KEY mtime) files.')
+    parser.add_argument('-Q', dest='modified', nargs='+', type=float, metavar='TIME', help='List files modified between FROM and TO (seconds since the epoch; TO defaults to now), newest first. Give after dataPort, if any.')
+    parser.add_argument('-r', dest='root', help='Direct the request to the server\'s root ROOT (see ftserver -R) instead of its default directory.')
+    parser.add_argument('-K', dest='bulk', action='store_true', default=False, help='Mark the request as bulk, so a server with traffic classes (ftserver -b) queues it behind interactive work.')
+    parser.add_argument('-D', dest='deadline', type=int, metavar='MS', help='Give the request a deadline MS milliseconds from now; the server drops it if it can\'t start or finish in time.')
+    parser.add_argument('-G', dest='getMany', nargs='+', metavar='FILE', help='Download several files concurrently. Give after dataPort, if any. Worker i listens on dataPort + i (0 picks free ports).')
+    parser.add_argument('-j', dest='jobs', default=8, type=int, help='Requests in flight at once for -G (default 8).')
+    parser.add_argument('-R', dest='recvMode', default='auto', choices=['auto', 'splice', 'copy'], help='How -g receives: splice moves data socket to file in the kernel, copy uses recv_into (default: splice where available).')
+    parser.add_argument('-W', dest='writerThread', action='store_true', default=False, help='With copy receives, write to disk from a separate thread.')
+    parser.add_argument('dataPort', nargs='?', default='0', type=str, help='Data connection port num. Optional; by default a free port is picked and sent to the server.')
 
 
     args = parser.parse_args()
@@ -30,26 +61,76 @@ def main():
     servPort = args.servPort[0]
     listDir = args.listDir
     fileName = args.fileName
-    dataPort = args.dataPort[0]
+    dataPort = args.dataPort
+
+    #Server-side file operations are sent as a single command line
+    command = None
+    if args.copy:
+        command = "-cp " + " ".join(args.copy)
+    elif args.move:
+        command = "-mv " + " ".join(args.move)
+    elif args.concat:
+        if len(args.concat) < 2:
+            parser.error("-a needs a destination and at least one source")
+        command = "-cat " + " ".join(args.concat)
+    elif args.metrics:
+        command = "-metrics"
+    elif args.probe:
+        command = "-probe " + args.probe
+    elif args.sink:
+        command = "-sink"
+    elif args.statMany:
+        command = "-stats"
+    elif args.top:
+        command = "-top " + " ".join(args.top)
+    elif args.modified:
+        command = "-range " + " ".join(str(int(t * 1e9)) for t in args.modified[:2])
 
+    #Batches run on the asyncio engine
+    if args.getMany:
+        asyncio.run(fetchMany(server, servPort, args.getMany, int(dataPort), max(args.jobs, 1)))
+        return
+
+    #Server-to-server transfers talk to both servers
+    if args.push:
+        pushBetween(server, servPort, args.push, dataPort)
+        return
+
+    #Start listening on the data port (a free one unless specified)
+    dataSocket = startListening(int(dataPort))
+    dataPort = listeningPort(dataSocket)
 
     #Create socket
     clientSocket = initiateContact(servPort, server)
     print("Connection established with server on port: " + str(servPort))
 
     #Send command or file name on control connection
-    makeRequest(listDir, fileName, clientSocket)
-
-    #Start listening on specified dataPort
-    dataSocket = startListening(int(dataPort))
+    makeRequest(listDir, fileName, clientSocket, command, args.root, args.bulk, args.deadline)
 
     #Send data port
-    clientSocket.sendall(dataPort)
+    sendMsg(clientSocket, dataPort)
 
-    #Receive file or response from server
-    transferSocket, addr = dataSocket.accept()
-    response = getServResponse(transferSocket)
-    handleResponse(response, transferSocket, fileName, dataPort)
+    #Receive file or response from server. Ctrl-C asks the server to
+    #stop sending, so it doesn't carry on until a write fails.
+    try:
+        transferSocket, addr = dataSocket.accept()
+        response = getServResponse(transferSocket)
+        if args.sink:
+            sinkUpload(response, transferSocket, parseSize(args.sink))
+        elif args.statMany:
+            results = statMany(response, transferSocket, args.statMany)
+            if results is None:
+                print("command unknown")
+            for name, kind, size, mtime in results or []:
+                if kind is None:
+                    print("%s: FILE NOT FOUND" % name)
+                else:
+                    print("%s %d %d %s" % (kind, size, mtime, name))
+        else:
+            handleResponse(response, transferSocket, fileName, dataPort, args.recvMode, args.writerThread)
+    except KeyboardInterrupt:
+        sendMsg(clientSocket, "-cancel")
+        print("\nTransfer cancelled.")
 
     #Close control connection sockets
     clientSocket.close()
@@ -81,41 +162,93 @@ def initiateContact(portNum, serverName):
 """ Function: startListening()
     Description: Creates a socket to which the server
         can connect and send data on the data port number
-        specified on the command-line.
+        specified on the command-line. Port 0 lets the system pick
+        a free port, so parallel runs never collide. The socket
+        can accept any number of data connections, one per request.
     Parameters: The data port number specified on the command-line.
-    Pre-Conditions: The data port number must be defined.
+    Pre-Conditions: None
     Post-Conditions: Returns a file descriptor to the opened
         socket.
 """
-def startListening(dataPort):
+def startListening(dataPort=0):
     #Open socket
     dataSocket = socket(AF_INET, SOCK_STREAM)
+    dataSocket.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
     dataSocket.bind(('', dataPort))
-    dataSocket.listen(1)
+    dataSocket.listen(16)
     return dataSocket
 
 
 
+""" Function: listeningPort()
+    Description: Returns the port a listening socket is bound to, as
+        the string sent to the server.
+    Parameters: The listening socket.
+    Pre-Conditions: The socket is bound.
+    Post-Conditions: Returns the port number string.
+"""
+def listeningPort(dataSocket):
+    return str(dataSocket.getsockname()[1])
+
+
+
+""" Function: sendMsg()
+    Description: Sends one control message padded with null bytes
+        to MSG_SIZE, the same fixed-size framing ftserver.c uses,
+        so the server's reads don't run the command and the data
+        port together.
+    Parameters: The socket file descriptor, the message string.
+    Pre-Conditions: The socket must be connected and the message
+        must be shorter than MSG_SIZE.
+    Post-Conditions: The padded message has been sent.
+"""
+def sendMsg(socketFD, msg):
+    socketFD.sendall(msg.encode().ljust(MSG_SIZE, b'\0'))
+
+
+
+""" Function: deadlinePrefix()
+    Description: Builds the "@ms " prefix giving a request a deadline,
+        as wall-clock milliseconds so time spent waiting for the
+        server to accept the connection counts against it.
+    Parameters: The deadline in milliseconds from now, or None.
+    Post-Conditions: Returns the prefix, empty for no deadline.
+"""
+def deadlinePrefix(ms):
+    if ms is None:
+        return ""
+    return "@%d " % (int(time.time() * 1000) + ms)
+
+
+
 """ Function: makeRequest()
     Description: Depending on which arguments were received on
         the command-line, this function either sends a request
         to get the server's directory listing or a request
-        to get the file specified.
+        to get the file specified, or a server-side file operation.
     Parameters: The variable storing the result of filename, the variable
         storing the result of -l, the connection sockets file
-        descriptor
-    Pre-Conditions: Either a filename must be specified or the
-        listDir variable must be True.
+        descriptor, an optional prebuilt command (-cp/-mv/-cat), an
+        optional server root to send it to, whether to mark it bulk and
+        an optional deadline in milliseconds from now.
+    Pre-Conditions: Either a filename or command must be specified or
+        the listDir variable must be True.
     Post-Conditions: Sends request to the server.
 """
-def makeRequest(listDir, fileName, socketFD):
+def makeRequest(listDir, fileName, socketFD, command=None, root=None, bulk=False, deadline=None):
+    #Requests for another root start with "/root ", then the deadline
+    #(wall-clock ms) and the class hint
+    prefix = ("/" + root + " " if root else "") + deadlinePrefix(deadline) + ("+bulk " if bulk else "")
+    #Server-side file operations take priority
+    if command is not None:
+        sendMsg(socketFD, prefix + command)
     #If listDir == True, send '-l' to server
-    if listDir == True:
+    elif listDir == True:
         command = "-l"
-        socketFD.send(command.encode())
+        sendMsg(socketFD, prefix + command)
     #Else send the filename over
     else:
-        socketFD.sendall(fileName.encode())
+        sendMsg(socketFD, prefix + fileName)
 
 
 
@@ -130,7 +263,14 @@ def makeRequest(listDir, fileName, socketFD):
     Post-Conditions: Returns the server's response as a string
 """
 def getServResponse(socketFD):
-    response = socketFD.recv(500).decode()
+    #Messages are always MSG_SIZE bytes but may arrive in pieces
+    response = b''
+    while len(response) < MSG_SIZE:
+        data = socketFD.recv(MSG_SIZE - len(response))
+        if not data:
+            break
+        response += data
+    response = response.decode()
     response = response.rstrip('\0')
     response = response.rstrip()
     return response
@@ -142,14 +282,16 @@ def getServResponse(socketFD):
         accepting and listing the server directory's contents
         -OR- accepting the file transfer.
     Parameters: The server's response, the connection
-        file descriptor
+        file descriptor, the file name, the data port, how to
+        receive files (see receiveFile())
     Pre-Conditions: There's an active connection between
         the client and server. The client has already
         made its request to the server.
     Post-Conditions: Will list the server's directory contents,
-        accept a file transfer, or display an error message.
+        accept a file transfer, report the result of a server-side
+        file operation, or display an error message.
 """
-def handleResponse(response, socketFD, transferFile, portNum):
+def handleResponse(response, socketFD, transferFile, portNum, recvMode='auto', writerThread=False):
     #If response is 'dir', accept directory contents
     if response == "dir":
         print ("Receiving directory structure from server: " + portNum)
@@ -158,14 +300,44 @@ def handleResponse(response, socketFD, transferFile, portNum):
             print(fileName)
             fileName = getServResponse(socketFD)
         return
-    #If response is 'fil', accept file transfer
-    elif response == "fil":
-        receiveFile(transferFile, socketFD, portNum)
+    #If response is 'met', print each counter
+    elif response == "met":
+        line = getServResponse(socketFD)
+        while line != "~done":
+            print(line)
+            line = getServResponse(socketFD)
+        return
+    #If response is 'qry', print the matching files
+    elif response == "qry":
+        for name, kind, size, mtime in readStatLines(socketFD):
+            print("%s %d %s %s" % (kind, size, time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(mtime / 1e9)), name))
+        return
+    #If response is 'prb', count the generated data
+    elif response.startswith("prb"):
+        receiveProbe(int(response.split()[1]), socketFD)
+        return
+    #If response is 'fil size', accept file transfer
+    elif response.split()[:1] == ["fil"]:
+        size = int(response.split()[1]) if len(response.split()) > 1 else 0
+        receiveFile(transferFile, socketFD, portNum, size, recvMode, writerThread)
         print("File transfer complete.")
         return
     elif response == "nof":
         print ("Server says: FILE NOT FOUND")
         return
+    #Server-side copy/move/concatenate results
+    elif response == "ok":
+        print ("Server says: OK")
+        return
+    elif response == "err":
+        print ("Server says: OPERATION FAILED")
+        return
+    elif response == "bsy":
+        print ("Server says: BUSY, try again later")
+        return
+    elif response == "exp":
+        print ("Server says: DEADLINE EXPIRED before the request could run")
+        return
     #Else if response is 'unk' print error message
     else:
         print("command unknown")
@@ -174,38 +346,756 @@ def handleResponse(response, socketFD, transferFile, portNum):
 
 
 
+""" Function: pushBetween()
+    Description: Has the server send a file directly to a second
+        ftserver. The receiving server is asked for a one-time token
+        and port first ("-rcv"), then the sending server is told to
+        push the file there ("-push"). Both servers connect back to
+        the same data port; the file itself never reaches the client.
+    Parameters: The sending server's name and port, the
+        (file name, receiving host, receiving port) triple from -t,
+        the data port number.
+    Pre-Conditions: Both servers must be running.
+    Post-Conditions: Prints transfer progress, throughput and the
+        receiving server's final result.
+"""
+def pushBetween(server, servPort, push, dataPort):
+    fileName, destHost, destPort = push
+    dataSocket = startListening(int(dataPort))
+    dataPort = listeningPort(dataSocket)
+
+    #Ask the receiving server to wait for the file
+    destSocket = initiateContact(int(destPort), destHost)
+    sendMsg(destSocket, "-rcv " + fileName)
+    sendMsg(destSocket, dataPort)
+    destTransfer, addr = dataSocket.accept()
+    response = getServResponse(destTransfer).split()
+    if not response or response[0] != "tok":
+        print("Receiving server refused the transfer.")
+        return
+    pushPort, token = response[1], response[2]
+
+    #Tell the sending server where to push it
+    srcSocket = initiateContact(servPort, server)
+    print("Connection established with server on port: " + str(servPort))
+    sendMsg(srcSocket, "-push %s %s %s %s" % (fileName, destHost, pushPort, token))
+    sendMsg(srcSocket, dataPort)
+    srcTransfer, addr = dataSocket.accept()
+
+    #Report progress until the sending server is done
+    response = getServResponse(srcTransfer).split()
+    while response and response[0] in ("psh", "prg"):
+        if response[0] == "psh":
+            print("Pushing \"%s\" (%s bytes) to %s:%s" % (fileName, response[1], destHost, destPort))
+        else:
+            print("  %s of %s bytes sent" % (response[1], response[2]))
+        response = getServResponse(srcTransfer).split()
+    if response and response[0] == "ok":
+        seconds = max(int(response[2]), 1) / 1e6
+        print("Sent %s bytes in %.2f s (%.1f MB/s)" % (response[1], seconds, int(response[1]) / seconds / 1e6))
+    else:
+        print("Server says: " + ("FILE NOT FOUND" if response == ["nof"] else "TRANSFER FAILED"))
+        #Release the receiving server's one-shot listener
+        try:
+            initiateContact(int(pushPort), destHost).close()
+        except error:
+            pass
+
+    #The receiving server confirms what it stored
+    response = getServResponse(destTransfer).split()
+    if response and response[0] == "ok":
+        print("Receiving server stored %s bytes." % response[1])
+    else:
+        print("Receiving server says: TRANSFER FAILED")
+    srcSocket.close()
+    destSocket.close()
+
+
+
+""" Function: parseSize()
+    Description: Parses a byte count with an optional k, m or g
+        suffix, like the server does.
+    Parameters: The string to parse.
+    Pre-Conditions: None
+    Post-Conditions: Returns the number of bytes.
+"""
+def parseSize(size):
+    units = {'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30}
+    if size[-1:].lower() in units:
+        return int(size[:-1]) * units[size[-1].lower()]
+    return int(size)
+
+
+
+""" Function: reportRate()
+    Description: Prints a byte count, time and throughput.
+    Parameters: A label, the byte count, the time in seconds.
+    Pre-Conditions: None
+    Post-Conditions: One line is printed.
+"""
+def reportRate(label, numBytes, seconds):
+    seconds = max(seconds, 1e-6)
+    print("%s %d bytes in %.3f s (%.1f MB/s)" % (label, numBytes, seconds, numBytes / seconds / 1e6))
+
+
+
+""" Function: receiveProbe()
+    Description: Reads and discards the server's generated probe data,
+        timing it from the first byte to the last.
+    Parameters: The number of bytes the server said it would send,
+        the connection file descriptor.
+    Pre-Conditions: The server has answered "prb".
+    Post-Conditions: Prints the throughput seen by the client.
+"""
+def receiveProbe(total, socketFD):
+    buf = bytearray(1 << 16)
+    got = 0
+    start = time.time()
+    n = socketFD.recv_into(buf)
+    while n:
+        got += n
+        n = socketFD.recv_into(buf)
+    reportRate("Received", got, time.time() - start)
+    if got != total:
+        print("Probe was short: expected %d bytes." % total)
+
+
+
+""" Function: sinkUpload()
+    Description: Sends generated data to a server in sink mode, then
+        shuts down the sending side and waits for the server's count.
+    Parameters: The server's response, the connection file
+        descriptor, the number of bytes to send.
+    Pre-Conditions: The "-sink" command has been sent.
+    Post-Conditions: Prints the throughput seen by both ends.
+"""
+def sinkUpload(response, socketFD, total):
+    if response != "snk":
+        print("Server refused the upload.")
+        return
+    chunk = bytes(bytearray(i % 26 + 97 for i in range(1 << 16)))
+    view = memoryview(chunk)
+    sent = 0
+    start = time.time()
+    while sent < total:
+        socketFD.sendall(view[:min(len(chunk), total - sent)])
+        sent += min(len(chunk), total - sent)
+    socketFD.shutdown(SHUT_WR)
+    reply = getServResponse(socketFD).split()
+    reportRate("Sent", sent, time.time() - start)
+    if reply and reply[0] == "ok":
+        reportRate("Server received", int(reply[1]), int(reply[2]) / 1e6)
+    else:
+        print("Server says: UPLOAD FAILED")
+
+
+
+""" Function: statMany()
+    Description: Runs a batch stat ("-stats"). The names go out on a
+        separate thread while the answers are read here, since the
+        server answers as names arrive and a long list would otherwise
+        fill both directions of the connection.
+    Parameters: The server's response, the connection file
+        descriptor, the file names.
+    Pre-Conditions: The "-stats" command has been sent.
+    Post-Conditions: Returns a list of (name, type, size, mtime in ns)
+        in request order, type being 'f' (file), 'd' (directory), 'o'
+        (other) or None if the name doesn't exist. Returns None if the
+        server refused.
+"""
+def statMany(response, socketFD, names):
+    if response != "bst":
+        return None
+    def sender():
+        try:
+            socketFD.sendall(b''.join(name.encode() + b'\n' for name in names))
+            socketFD.shutdown(SHUT_WR)
+        except OSError:
+            pass
+    thread = threading.Thread(target=sender, daemon=True)
+    thread.start()
+    results = readStatLines(socketFD)
+    thread.join()
+    return results
+
+
+
+""" Function: readStatLines()
+    Description: Reads "<type> <size> <mtime> <name>" lines, as sent
+        for "-stats", "-top" and "-range", until the server closes the
+        connection.
+    Parameters: The connection file descriptor.
+    Pre-Conditions: The server's first reply has been read.
+    Post-Conditions: Returns a list of (name, type, size, mtime in
+        ns), type None for names that don't exist.
+"""
+def readStatLines(socketFD):
+    results = []
+    with socketFD.makefile('rb') as answers:
+        for line in answers:
+            kind, size, mtime, name = line.decode().rstrip('\n').split(' ', 3)
+            results.append((name, None if kind == '-' else kind, int(size), int(mtime)))
+    return results
+
+
+
+""" Function: fetchMany()
+    Description: Downloads a list of files with up to "jobs" requests
+        in flight, then prints the aggregate throughput. Each worker
+        keeps one data listener for all of its requests; control
+        connections are opened per request because a worker only
+        sends its next command once the last file is in, and a
+        blocking-mode server doesn't keep an idle control connection
+        open (it serves one only while commands are already waiting).
+    Parameters: The server name and port, the file names, the first
+        data port (0 for free ports), the concurrency limit.
+    Pre-Conditions: The server must be running.
+    Post-Conditions: Files are written to the current directory; one
+        line is printed per file plus a summary.
+"""
+async def fetchMany(server, servPort, fileNames, dataPort, jobs):
+    queue = asyncio.Queue()
+    for fileName in fileNames:
+        queue.put_nowait(fileName)
+    totals = {'files': 0, 'bytes': 0, 'failed': 0}
+    servIP = gethostbyname(server)
+    jobs = min(jobs, len(fileNames))
+
+    start = time.time()
+    await asyncio.gather(*(fetchWorker(servIP, servPort, queue, dataPort + i if dataPort else 0, totals)
+                           for i in range(jobs)))
+    elapsed = max(time.time() - start, 1e-6)
+    print("%d files, %d bytes in %.2f s: %.1f files/s, %.1f MB/s, %d failed"
+          % (totals['files'], totals['bytes'], elapsed, totals['files'] / elapsed,
+             totals['bytes'] / elapsed / 1e6, totals['failed']))
+
+
+
+""" Function: fetchWorker()
+    Description: One -G worker: takes file names off the queue until
+        it is empty and fetches each through its own data listener.
+    Parameters: The server IP and port, the shared queue, this
+        worker's data port (0 for a free one), the shared totals.
+    Pre-Conditions: None
+    Post-Conditions: The listener is closed; totals are updated.
+"""
+async def fetchWorker(servIP, servPort, queue, dataPort, totals):
+    loop = asyncio.get_running_loop()
+    listener = startListening(dataPort)
+    listener.setblocking(False)
+    port = listeningPort(listener)
+    try:
+        while not queue.empty():
+            fileName = queue.get_nowait()
+            try:
+                numBytes = await fetchOne(loop, servIP, servPort, listener, port, fileName)
+            except (OSError, EOFError) as e:
+                numBytes = None
+                print("%s: %s" % (fileName, e))
+            if numBytes is None:
+                totals['failed'] += 1
+            else:
+                totals['files'] += 1
+                totals['bytes'] += numBytes
+    finally:
+        listener.close()
+
+
+
+""" Function: fetchOne()
+    Description: Requests one file and stores it, without blocking
+        the other workers.
+    Parameters: The event loop, the server IP and port, the worker's
+        data listener and its port number string, the file name.
+    Pre-Conditions: The listener is listening and non-blocking.
+    Post-Conditions: Returns the bytes received, or None if the server
+        didn't send the file or it already exists locally.
+"""
+async def fetchOne(loop, servIP, servPort, listener, port, fileName):
+    if os.path.isfile(fileName):
+        print("%s: already exists, skipped" % fileName)
+        return None
+    reader, writer = await asyncio.open_connection(servIP, servPort)
+    try:
+        writer.write(fileName.encode().ljust(MSG_SIZE, b'\0') + port.encode().ljust(MSG_SIZE, b'\0'))
+        await writer.drain()
+        conn, addr = await loop.sock_accept(listener)
+        dataReader, dataWriter = await asyncio.open_connection(sock=conn)
+    finally:
+        writer.close()
+    try:
+        response = (await dataReader.readexactly(MSG_SIZE)).rstrip(b'\0').decode().rstrip()
+        if response.split()[:1] != ["fil"]:
+            print("%s: %s" % (fileName, "FILE NOT FOUND" if response == "nof" else response))
+            return None
+        numBytes = 0
+        with open(fileName, "wb") as file:
+            data = await dataReader.read(1 << 16)
+            while data:
+                file.write(data)
+                numBytes += len(data)
+                data = await dataReader.read(1 << 16)
+        print("%s: %d bytes" % (fileName, numBytes))
+        return numBytes
+    finally:
+        dataWriter.close()
+
+
+
 """ Function: receiveFile()
     Description: Opens a new file for writing the transferred
         file contents to. If file name already exists, prompts
-        the user to rename the new file.
+        the user to rename the new file. The file is preallocated
+        to the size the server announced, and data is moved with
+        splice() (socket to pipe to file, never entering Python) or
+        received with recv_into() into reused buffers.
     Parameters: The file name specified on the command-line, the
-        file descriptor for the connection.
+        file descriptor for the connection, the data port, the size
+        the server announced (0 if unknown), the receive mode
+        ('auto', 'splice' or 'copy'), whether copy mode writes from
+        a separate thread.
     Pre-Conditions: There must be an open connection between
         the client and the server. The file name must be specified.
     Post-Conditions: The file transferred will be written to the
         client's directory.
 """
-def receiveFile(fileName, socketFD, portNum):
+def receiveFile(fileName, socketFD, portNum, size=0, recvMode='auto', writerThread=False):
     print("Receiving \"" + fileName + "\" from server on " + portNum)
     #Check file does not already exist
     #If file name exists, prompt user for action
     while os.path.isfile('./'+ fileName):
         #Handle renaming or replacement
         print("File name already in use.")
-        fileName = raw_input("Please enter new name for file: ")
-
-    #Open file for writing
-    file = open(fileName, "w")
-    #Receive file contents
-    data = socketFD.recv(500)
-    while data:
-        file.write(data)
-        data = socketFD.recv(500)
-    #Close file
-    file.close()
+        fileName = input("Please enter new name for file: ")
+
+    #Open file for writing and reserve its space up front
+    fd = os.open(fileName, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+    try:
+        if size > 0:
+            try:
+                os.posix_fallocate(fd, 0, size)
+            except OSError:
+                pass
+        if recvMode == 'splice' or (recvMode == 'auto' and hasattr(os, 'splice') and not writerThread):
+            received = spliceToFile(socketFD, fd)
+        elif writerThread:
+            received = recvThreaded(socketFD, fd)
+        else:
+            received = recvToFile(socketFD, fd)
+        #Trim the reservation if the file came up short
+        os.ftruncate(fd, received)
+    finally:
+        os.close(fd)
 
     return
 
 
+
+""" Function: spliceToFile()
+    Description: Moves everything left on the socket into the file
+        through a pipe with os.splice(), so the data never leaves
+        the kernel. A socket with a timeout is non-blocking
+        underneath, so an empty socket is waited on with select()
+        for up to that timeout.
+    Parameters: The connection socket, the destination file
+        descriptor.
+    Pre-Conditions: Linux with Python 3.10 or newer.
+    Post-Conditions: Returns the number of bytes written, or raises
+        socket.timeout if the socket stays empty past its timeout.
+"""
+def spliceToFile(socketFD, fd):
+    chunk = 1 << 20
+    pipeRead, pipeWrite = os.pipe()
+    received = 0
+    try:
+        while True:
+            try:
+                n = os.splice(socketFD.fileno(), pipeWrite, chunk)
+            except BlockingIOError:
+                if not select.select([socketFD], [], [], socketFD.gettimeout())[0]:
+                    raise timeout("timed out")
+                continue
+            if n == 0:
+                break
+            while n > 0:
+                written = os.splice(pipeRead, fd, n, offset_dst=received)
+                received += written
+                n -= written
+    finally:
+        os.close(pipeRead)
+        os.close(pipeWrite)
+    return received
+
+
+
+""" Function: recvToFile()
+    Description: Receives with recv_into() into one reused buffer and
+        writes each piece at its offset.
+    Parameters: The connection socket, the destination file
+        descriptor.
+    Pre-Conditions: None
+    Post-Conditions: Returns the number of bytes written.
+"""
+def recvToFile(socketFD, fd):
+    view = memoryview(bytearray(1 << 20))
+    received = 0
+    n = socketFD.recv_into(view)
+    while n:
+        os.pwrite(fd, view[:n], received)
+        received += n
+        n = socketFD.recv_into(view)
+    return received
+
+
+
+""" Function: recvThreaded()
+    Description: Like recvToFile(), but a writer thread does the disk
+        writes so a slow disk doesn't stall the socket. Buffers cycle
+        between the two through a pair of queues, so memory stays
+        bounded and nothing is allocated per chunk.
+    Parameters: The connection socket, the destination file
+        descriptor.
+    Pre-Conditions: None
+    Post-Conditions: Returns the number of bytes written.
+"""
+def recvThreaded(socketFD, fd):
+    free = queues.Queue()
+    full = queues.Queue()
+    for i in range(8):
+        free.put(memoryview(bytearray(1 << 20)))
+    errors = []
+
+    def writer():
+        while True:
+            item = full.get()
+            if item is None:
+                return
+            view, n, offset = item
+            try:
+                os.pwrite(fd, view[:n], offset)
+            except OSError as e:
+                errors.append(e)
+            free.put(view)
+
+    thread = threading.Thread(target=writer)
+    thread.start()
+    received = 0
+    try:
+        while True:
+            #Fill a whole buffer before handing it over
+            view = free.get()
+            n = 0
+            while n < len(view):
+                got = socketFD.recv_into(view[n:])
+                if not got:
+                    break
+                n += got
+            if n:
+                full.put((view, n, received))
+                received += n
+            if n < len(view):
+                break
+    finally:
+        full.put(None)
+        thread.join()
+    if errors:
+        raise errors[0]
+    return received
+
+
+
+""" Class: FTError
+    Description: Raised by Client when the server refuses a request:
+        "nof" (no such file or root), "err", "unk", "bsy" (the
+        root is serving its quota of requests, the bulk queue is full
+        or the server is stopping) or "exp" (the
+        request's deadline passed), or when a transfer is cut off by
+        its deadline.
+"""
+class FTError(Exception):
+    pass
+
+
+
+""" Class: Client
+    Description: Library access to one ftserver. Requests take a data
+        listener from a pool of up to poolSize, so at most poolSize
+        requests are in flight and listeners are reused instead of
+        bound per request. Safe to share between threads.
+    Parameters: The server name and port, the pool size, the first
+        data port (0 picks free ports), a socket timeout in seconds,
+        the server root to use (None for its default directory), and
+        a deadline in seconds each request must finish within (None
+        for none).
+"""
+class Client:
+    def __init__(self, server, servPort, poolSize=8, dataPort=0, timeout=30, root=None, deadline=None):
+        self.servIP = gethostbyname(server)
+        self.servPort = servPort
+        self.prefix = "/" + root + " " if root else ""
+        self.deadline = deadline
+        self.timeout = timeout
+        self.pool = queues.Queue()
+        self.lock = threading.Lock()
+        self.listeners = []
+        self.closed = False
+        for i in range(poolSize):
+            listener = startListening(dataPort + i if dataPort else 0)
+            listener.settimeout(timeout)
+            self.listeners.append(listener)
+            self.pool.put(listener)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    """ Function: close()
+        Description: Closes every pooled listener. Requests in flight
+            finish first.
+    """
+    def close(self):
+        with self.lock:
+            if self.closed:
+                return
+            self.closed = True
+        for i in range(len(self.listeners)):
+            self.pool.get().close()
+
+    """ Function: request()
+        Description: Sends one command and returns the data connection
+            and the server's first reply. The caller must call done()
+            with both when finished. If the request fails, its
+            listener is replaced (see replace()).
+        Parameters: The command string.
+        Post-Conditions: Returns (data socket, listener, reply).
+    """
+    def request(self, command):
+        if self.closed:
+            raise FTError("client is closed")
+        listener = self.pool.get()
+        try:
+            control = create_connection((self.servIP, self.servPort), self.timeout)
+            try:
+                port = listeningPort(listener)
+                prefix = self.prefix + deadlinePrefix(None if self.deadline is None else int(self.deadline * 1000))
+                control.sendall((prefix + command).encode().ljust(MSG_SIZE, b'\0') + port.encode().ljust(MSG_SIZE, b'\0'))
+                data, addr = listener.accept()
+            finally:
+                control.close()
+            data.settimeout(self.timeout)
+            return data, listener, getServResponse(data)
+        except BaseException:
+            self.replace(listener)
+            raise
+
+    def done(self, data, listener):
+        data.close()
+        self.pool.put(listener)
+
+    """ Function: replace()
+        Description: Closes a listener whose request failed and pools
+            a fresh one on a free port instead, since the server may
+            still connect back for the abandoned request and that
+            connection must not be taken as the next request's. If no
+            new listener can be opened the pool just shrinks.
+    """
+    def replace(self, listener):
+        listener.close()
+        try:
+            fresh = startListening()
+            fresh.settimeout(self.timeout)
+        except OSError:
+            with self.lock:
+                self.listeners.remove(listener)
+            return
+        with self.lock:
+            self.listeners[self.listeners.index(listener)] = fresh
+        self.pool.put(fresh)
+
+    """ Function: check()
+        Description: Raises FTError unless reply starts with expected.
+    """
+    def check(self, reply, expected, what):
+        if reply.split()[:1] != [expected]:
+            raise FTError("%s: %s" % (what, {"nof": "file not found", "err": "operation failed",
+                                             "unk": "command unknown",
+                                             "bsy": "server busy",
+                                             "exp": "deadline expired"}.get(reply, reply)))
+
+    """ Function: list()
+        Description: Returns the server directory's entry names.
+    """
+    def list(self):
+        data, listener, reply = self.request("-l")
+        try:
+            self.check(reply, "dir", "-l")
+            names = []
+            name = getServResponse(data)
+            while name != "~done":
+                names.append(name)
+                name = getServResponse(data)
+            return names
+        finally:
+            self.done(data, listener)
+
+    """ Function: get()
+        Description: Downloads fileName to path (default: same name in
+            the current directory), overwriting it, preallocated and
+            spliced like receiveFile(). Returns the bytes received.
+    """
+    def get(self, fileName, path=None):
+        data, listener, reply = self.request(fileName)
+        try:
+            self.check(reply, "fil", fileName)
+            size = int(reply.split()[1]) if len(reply.split()) > 1 else 0
+            fd = os.open(path or fileName, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+            try:
+                if size > 0:
+                    try:
+                        os.posix_fallocate(fd, 0, size)
+                    except OSError:
+                        pass
+                received = spliceToFile(data, fd) if hasattr(os, 'splice') else recvToFile(data, fd)
+                os.ftruncate(fd, received)
+            finally:
+                os.close(fd)
+            if self.deadline is not None and received < size:
+                raise FTError("%s: deadline expired" % fileName)
+            return received
+        finally:
+            self.done(data, listener)
+
+    """ Function: getBuffer()
+        Description: Downloads fileName into memory. The buffer is
+            sized from the server's announcement and filled in place
+            with recv_into(). Returns the contents as bytes.
+    """
+    def getBuffer(self, fileName):
+        data, listener, reply = self.request(fileName)
+        try:
+            self.check(reply, "fil", fileName)
+            size = int(reply.split()[1]) if len(reply.split()) > 1 else 0
+            buf = bytearray(max(size, 1 << 16))
+            view = memoryview(buf)
+            received = 0
+            while True:
+                if received == len(buf):
+                    #Full: either the file is done or it grew
+                    more = data.recv(1 << 16)
+                    if not more:
+                        break
+                    view.release()
+                    buf[received:] = more
+                    received += len(more)
+                    buf.extend(bytes(len(buf)))
+                    view = memoryview(buf)
+                    continue
+                n = data.recv_into(view[received:])
+                if not n:
+                    break
+                received += n
+            view.release()
+            del buf[received:]
+            if self.deadline is not None and received < size:
+                raise FTError("%s: deadline expired" % fileName)
+            return bytes(buf)
+        finally:
+            self.done(data, listener)
+
+    """ Function: stat()
+        Description: Returns (size, mtime in ns, hash as a hex string)
+            for fileName.
+    """
+    def stat(self, fileName):
+        data, listener, reply = self.request("-s " + fileName)
+        try:
+            self.check(reply, "sta", fileName)
+            fields = reply.split()
+            return int(fields[1]), int(fields[2]), fields[3]
+        finally:
+            self.done(data, listener)
+
+    """ Function: statMany()
+        Description: Returns {name: (type, size, mtime in ns)} for
+            many names in one request; type is 'f', 'd' or 'o', and
+            names that don't exist map to None.
+    """
+    def statMany(self, fileNames):
+        data, listener, reply = self.request("-stats")
+        try:
+            self.check(reply, "bst", "-stats")
+            return {name: (kind, size, mtime) if kind else None
+                    for name, kind, size, mtime in statMany(reply, data, fileNames)}
+        finally:
+            self.done(data, listener)
+
+    """ Function: top()
+        Description: Returns [(name, size, mtime in ns)] for the n
+            largest (key "size") or newest (key "mtime") files.
+    """
+    def top(self, key, n):
+        return self.query("-top %s %d" % (key, n))
+
+    """ Function: modified()
+        Description: Returns [(name, size, mtime in ns)] for files
+            modified from start to end (ns since the epoch; end None
+            for no limit), newest first.
+    """
+    def modified(self, start, end=None):
+        return self.query("-range %d" % start + ("" if end is None else " %d" % end))
+
+    def query(self, command):
+        data, listener, reply = self.request(command)
+        try:
+            self.check(reply, "qry", command)
+            return [(name, size, mtime) for name, kind, size, mtime in readStatLines(data)]
+        finally:
+            self.done(data, listener)
+
+
+
+""" Class: AsyncClient
+    Description: asyncio front end for Client. Each call runs the
+        blocking request on a worker thread, so up to poolSize
+        requests overlap without blocking the event loop.
+    Parameters: Same as Client.
+"""
+class AsyncClient:
+    def __init__(self, *args, **kwargs):
+        self.client = Client(*args, **kwargs)
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        await self.close()
+
+    async def close(self):
+        await asyncio.to_thread(self.client.close)
+
+    async def list(self):
+        return await asyncio.to_thread(self.client.list)
+
+    async def get(self, fileName, path=None):
+        return await asyncio.to_thread(self.client.get, fileName, path)
+
+    async def getBuffer(self, fileName):
+        return await asyncio.to_thread(self.client.getBuffer, fileName)
+
+    async def stat(self, fileName):
+        return await asyncio.to_thread(self.client.stat, fileName)
+
+    async def statMany(self, fileNames):
+        return await asyncio.to_thread(self.client.statMany, fileNames)
+
+    async def top(self, key, n):
+        return await asyncio.to_thread(self.client.top, key, n)
+
+    async def modified(self, start, end=None):
+        return await asyncio.to_thread(self.client.modified, start, end)
+
+
 if __name__ == '__main__':
     main()
@@ -0,0 +1,595 @@
+/********************************************************************
+ * ** Program Filename: ftload.c
+ * ** Description: Load generator for ftserver.c. Runs many ftserver
+ *      requests at once from a single epoll loop, speaking the same
+ *      protocol as ftclient.py: each request opens a control
+ *      connection, sends its command and a data port, and the server
+ *      connects back to that port with the response.
+ * ** Input: Server name and port, plus options:
+ *          -c conns    requests in flight at once (default 16)
+ *          -d seconds  how long to run (default 10)
+ *          -r rate     open loop: start rate requests per second on
+ *                      a fixed schedule (default: closed loop)
+ *          -m w:cmd    add cmd to the request mix with weight w, e.g.
+ *                      -m 1:-l -m 9:file.txt (default -m 1:-l)
+ *          -R log      replay the requests in an ftserver access log
+ *                      (-L) instead of using a mix, at their recorded
+ *                      times; -d is ignored
+ *          -x speed    replay speed-up factor (default 1); 0 replays
+ *                      as fast as -c allows
+ *          -D log      print an access log as text and exit
+ * ** Output: Throughput, error counts and a latency distribution.
+ *      In open loop and timed replay modes latency is measured from
+ *      when each request was scheduled to start, not when it actually
+ *      started, so time spent waiting behind a slow server is counted
+ *      (coordinated omission correction).
+ * *********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "ftlog.h" //access log record layout
+#define BUFFER_SIZE 500 //Size of every ftserver control message
+#define MAX_MIX 32 //Most distinct commands in a request mix
+#define MAX_EVENTS 256
+#define HIST_SUB 16 //Histogram buckets per power of two
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define DATA_CHUNK (1 << 16)
+#define RETRY_USEC 100000 //Closed loop pause after a pass of only failures
+
+//One command in the request mix
+struct mixEntry {
+    int weight;
+    char *cmd;
+};
+
+//One request in flight. Each of its sockets is registered with
+//epoll pointing at one of the three handles, so an event leads back
+//to both the request and the socket it happened on.
+struct request {
+    struct handle {
+        struct request *req;
+        int kind; //0 control, 1 data listener, 2 data connection
+    } h[3];
+    int ctrlFD, listenFD, dataFD;
+    long long start; //When the request was scheduled to start
+    long long bytes;
+    char reply[BUFFER_SIZE];
+    int replyLen;
+    char out[2 * BUFFER_SIZE];
+    int outLen, outSent;
+};
+
+//Latency histogram, log-linear in microseconds
+struct histogram {
+    long long counts[HIST_BUCKETS];
+    long long total, max, sum;
+};
+
+struct addrinfo *server;
+struct mixEntry mix[MAX_MIX];
+int mixCount = 0, mixWeight = 0;
+int epollFD;
+long long completed = 0, errors = 0, notFound = 0, bytesReceived = 0;
+struct histogram hist;
+
+//Access log being replayed, mapped whole
+char *replayLog = NULL;
+long long replayLen = 0, replayPos = 8;
+
+
+
+/*********************************************************************
+ * ** Function: error
+ * ** Description: Prints a descriptive error message and exits.
+ * ** Parameters: Takes a constant char message
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Will exit the program.
+ * *********************************************************************/
+void error(const char *msg){
+    perror(msg);
+    exit(1);
+}
+
+
+
+/*********************************************************************
+ * ** Function: nowUsec()
+ * ** Description: Returns a monotonic timestamp in microseconds.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the current monotonic time.
+ * *********************************************************************/
+long long nowUsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+/*********************************************************************
+ * ** Function: histBucket()
+ * ** Description: Maps a latency to its histogram bucket. Each power
+ *      of two is split into HIST_SUB buckets, so every bucket is
+ *      within about 6% of the values it holds.
+ * ** Parameters: The latency in microseconds.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns a bucket index below HIST_BUCKETS.
+ * *********************************************************************/
+int histBucket(long long usec){
+    if(usec < HIST_SUB) return usec < 0 ? 0 : usec;
+    int bits = 63 - __builtin_clzll(usec);
+    int sub = (usec >> (bits - 4)) & (HIST_SUB - 1);
+    return (bits - 3) * HIST_SUB + sub;
+}
+
+
+
+/*********************************************************************
+ * ** Function: histValue()
+ * ** Description: Returns the smallest latency a bucket holds.
+ * ** Parameters: The bucket index.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns a latency in microseconds.
+ * *********************************************************************/
+long long histValue(int bucket){
+    if(bucket < HIST_SUB) return bucket;
+    int bits = bucket / HIST_SUB + 3;
+    return (1LL << bits) | ((long long) (bucket % HIST_SUB) << (bits - 4));
+}
+
+
+
+/*********************************************************************
+ * ** Function: histPercentile()
+ * ** Description: Returns the latency below which the given fraction
+ *      of recorded requests fall.
+ * ** Parameters: The histogram, the fraction (0 to 1).
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns a latency in microseconds.
+ * *********************************************************************/
+long long histPercentile(struct histogram *h, double fraction){
+    long long want = (long long) (fraction * h->total + 0.5), seen = 0;
+    int i;
+    if(want < 1) want = 1;
+    for(i = 0; i < HIST_BUCKETS; i++){
+        seen += h->counts[i];
+        if(seen >= want) return histValue(i);
+    }
+    return h->max;
+}
+
+
+
+/*********************************************************************
+ * ** Function: watch()
+ * ** Description: Registers (or re-registers) a request's socket with
+ *      epoll.
+ * ** Parameters: The request, which of its sockets, the epoll events
+ *      wanted, EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+ * ** Pre-Conditions: The socket must be open.
+ * ** Post-Conditions: epoll will report the events for that socket.
+ * *********************************************************************/
+void watch(struct request *req, int kind, int events, int op){
+    int fd = kind == 0 ? req->ctrlFD : kind == 1 ? req->listenFD : req->dataFD;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &req->h[kind];
+    if(epoll_ctl(epollFD, op, fd, &ev) < 0) error("ERROR on epoll_ctl");
+}
+
+
+
+/*********************************************************************
+ * ** Function: finish()
+ * ** Description: Closes a request's sockets and records its outcome.
+ * ** Parameters: The request, whether it failed.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The request is freed.
+ * *********************************************************************/
+void finish(struct request *req, int failed){
+    if(req->ctrlFD >= 0) close(req->ctrlFD);
+    if(req->listenFD >= 0) close(req->listenFD);
+    if(req->dataFD >= 0) close(req->dataFD);
+
+    if(failed) errors++;
+    else {
+        long long latency = nowUsec() - req->start;
+        completed++;
+        bytesReceived += req->bytes;
+        if(strncmp(req->reply, "nof", 3) == 0) notFound++;
+        hist.counts[histBucket(latency)]++;
+        hist.total++;
+        hist.sum += latency;
+        if(latency > hist.max) hist.max = latency;
+    }
+    free(req);
+}
+
+
+
+/*********************************************************************
+ * ** Function: startRequest()
+ * ** Description: Opens a listener on an ephemeral data port and
+ *      starts connecting to the server to send a command.
+ * ** Parameters: The command, the time the request was scheduled to
+ *      start.
+ * ** Pre-Conditions: The server address and mix must be set.
+ * ** Post-Conditions: Returns 0 if the request is under way, -1 if it
+ *      was counted as an error.
+ * *********************************************************************/
+int startRequest(const char *cmd, long long scheduled){
+    struct request *req = calloc(1, sizeof(*req));
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int i;
+
+    req->start = scheduled;
+    req->dataFD = -1;
+    for(i = 0; i < 3; i++){
+        req->h[i].req = req;
+        req->h[i].kind = i;
+    }
+
+    //Listen for the server's data connection on any free port
+    req->listenFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    req->ctrlFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(req->listenFD < 0 || req->ctrlFD < 0
+            || bind(req->listenFD, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(req->listenFD, 1) < 0
+            || getsockname(req->listenFD, (struct sockaddr *) &addr, &addrLen) < 0){
+        finish(req, 1);
+        return -1;
+    }
+
+    //Both control messages go out in one write, each padded to
+    //the server's message size
+    strncpy(req->out, cmd, BUFFER_SIZE - 1);
+    snprintf(req->out + BUFFER_SIZE, BUFFER_SIZE, "%i", ntohs(addr.sin_port));
+    req->outLen = 2 * BUFFER_SIZE;
+
+    if(connect(req->ctrlFD, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS){
+        finish(req, 1);
+        return -1;
+    }
+    watch(req, 0, EPOLLOUT, EPOLL_CTL_ADD);
+    watch(req, 1, EPOLLIN, EPOLL_CTL_ADD);
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: handleEvent()
+ * ** Description: Advances a request when one of its sockets is
+ *      ready: sends the control messages once connected, accepts the
+ *      server's data connection, and reads the response to EOF.
+ * ** Parameters: The epoll handle that fired, the events reported.
+ * ** Pre-Conditions: The request must be in flight.
+ * ** Post-Conditions: Returns 1 if the request finished (either way).
+ * *********************************************************************/
+int handleEvent(struct handle *h, int events){
+    static char data[DATA_CHUNK];
+    struct request *req = h->req;
+
+    if(h->kind == 0){
+        //Control connection: write the command and port
+        if(events & (EPOLLERR | EPOLLHUP)){
+            finish(req, 1);
+            return 1;
+        }
+        int n = write(req->ctrlFD, req->out + req->outSent, req->outLen - req->outSent);
+        if(n < 0 && errno != EAGAIN){
+            finish(req, 1);
+            return 1;
+        }
+        if(n > 0) req->outSent += n;
+        //Nothing more to say; the server never replies on this socket
+        if(req->outSent == req->outLen)
+            epoll_ctl(epollFD, EPOLL_CTL_DEL, req->ctrlFD, NULL);
+        return 0;
+    }
+    if(h->kind == 1){
+        //Data listener: the server is connecting back
+        req->dataFD = accept4(req->listenFD, NULL, NULL, SOCK_NONBLOCK);
+        if(req->dataFD < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+        if(req->dataFD < 0){
+            finish(req, 1);
+            return 1;
+        }
+        close(req->listenFD);
+        req->listenFD = -1;
+        watch(req, 2, EPOLLIN, EPOLL_CTL_ADD);
+        return 0;
+    }
+
+    //Data connection: the reply message, then any payload until EOF
+    while(1){
+        int n = read(req->dataFD, data, sizeof(data));
+        if(n < 0 && errno == EAGAIN) return 0;
+        if(n < 0){
+            finish(req, 1);
+            return 1;
+        }
+        if(n == 0){
+            finish(req, req->replyLen < BUFFER_SIZE);
+            return 1;
+        }
+        int header = 0;
+        if(req->replyLen < BUFFER_SIZE){
+            header = n < BUFFER_SIZE - req->replyLen ? n : BUFFER_SIZE - req->replyLen;
+            memcpy(req->reply + req->replyLen, data, header);
+            req->replyLen += header;
+        }
+        req->bytes += n - header;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: pickMix()
+ * ** Description: Picks a command from the mix at random, by weight.
+ * ** Parameters: None
+ * ** Pre-Conditions: The mix must not be empty.
+ * ** Post-Conditions: Returns the command.
+ * *********************************************************************/
+const char *pickMix(){
+    int i, pick = rand() % mixWeight;
+    for(i = 0; pick >= mix[i].weight; i++) pick -= mix[i].weight;
+    return mix[i].cmd;
+}
+
+
+
+/*********************************************************************
+ * ** Function: loadLog()
+ * ** Description: Reads a whole access log into memory and checks its
+ *      header.
+ * ** Parameters: The log's path.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: replayLog holds the log, or the program exits.
+ * *********************************************************************/
+void loadLog(const char *path){
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) error("ERROR opening access log");
+    replayLen = st.st_size;
+    replayLog = malloc(replayLen + 1);
+    long long got = 0;
+    while(got < replayLen){
+        int n = read(fd, replayLog + got, replayLen - got);
+        if(n <= 0) error("ERROR reading access log");
+        got += n;
+    }
+    close(fd);
+    if(replayLen < 8 || memcmp(replayLog, ACCESS_LOG_MAGIC, 8) != 0){
+        fprintf(stderr, "ERROR, %s is not an ftserver access log\n", path);
+        exit(1);
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: nextRecord()
+ * ** Description: Steps through the loaded access log.
+ * ** Parameters: A BUFFER_SIZE buffer to receive the record's command.
+ * ** Pre-Conditions: loadLog() must have run.
+ * ** Post-Conditions: Returns the next record, or NULL at the end (or
+ *      at a truncated record).
+ * *********************************************************************/
+struct accessRecord *nextRecord(char *cmd){
+    struct accessRecord *rec = (struct accessRecord *) (replayLog + replayPos);
+    if(replayPos + (long long) sizeof(*rec) > replayLen
+            || replayPos + (long long) sizeof(*rec) + rec->nameLen > replayLen
+            || rec->nameLen >= BUFFER_SIZE)
+        return NULL;
+    memcpy(cmd, replayLog + replayPos + sizeof(*rec), rec->nameLen);
+    cmd[rec->nameLen] = '\0';
+    replayPos += sizeof(*rec) + rec->nameLen;
+    return rec;
+}
+
+
+
+/*********************************************************************
+ * ** Function: dumpLog()
+ * ** Description: Prints every record of an access log as a line of
+ *      text: time, client, kind, bytes, latency and command.
+ * ** Parameters: The log's path.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The log is printed.
+ * *********************************************************************/
+void dumpLog(const char *path){
+    const char *kinds[] = { "get", "list", "other" };
+    char cmd[BUFFER_SIZE], client[INET_ADDRSTRLEN];
+    struct accessRecord *rec;
+
+    loadLog(path);
+    while((rec = nextRecord(cmd)) != NULL){
+        struct in_addr addr = { rec->client };
+        inet_ntop(AF_INET, &addr, client, sizeof(client));
+        printf("%llu.%06llu %s %s %llu %u %s\n",
+                (unsigned long long) rec->timeUsec / 1000000, (unsigned long long) rec->timeUsec % 1000000,
+                client, rec->command <= ACCESS_OTHER ? kinds[rec->command] : "?",
+                (unsigned long long) rec->bytes, rec->latencyUsec, cmd);
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: addMix()
+ * ** Description: Parses a "-m weight:command" option into the mix.
+ * ** Parameters: The option's argument.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The command is added, or the program exits.
+ * *********************************************************************/
+void addMix(char *spec){
+    char *colon = strchr(spec, ':');
+    if(colon == NULL || mixCount == MAX_MIX || atoi(spec) < 1){
+        fprintf(stderr, "ERROR, -m takes weight:command\n");
+        exit(1);
+    }
+    mix[mixCount].weight = atoi(spec);
+    mix[mixCount].cmd = colon + 1;
+    mixWeight += mix[mixCount].weight;
+    mixCount++;
+}
+
+
+
+/*MAIN*/
+int main(int argc, char *argv[]){
+    struct epoll_event events[MAX_EVENTS];
+    struct addrinfo hints;
+    int conns = 16, seconds = 10, opt, i;
+    double rate = 0, speed = 1;
+    const char *usage = "usage: ./ftload [-c conns] [-d seconds] [-r rate] [-m weight:cmd]..."
+        " [-R log [-x speed]] host port\n       ./ftload -D log\n";
+
+    while((opt = getopt(argc, argv, "c:d:r:m:R:x:D:")) != -1){
+        switch(opt){
+            case 'c': conns = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'm': addMix(optarg); break;
+            case 'R': loadLog(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'D':
+                dumpLog(optarg);
+                return 0;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
+    if(argc - optind != 2 || conns < 1 || seconds < 1 || speed < 0){
+        printf("%s", usage);
+        exit(1);
+    }
+    if(mixCount == 0) addMix(strdup("1:-l"));
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(argv[optind], argv[optind + 1], &hints, &server) != 0){
+        fprintf(stderr, "ERROR, unknown server %s\n", argv[optind]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    epollFD = epoll_create1(0);
+    if(epollFD < 0) error("ERROR creating epoll");
+
+    //Closed loop keeps conns requests in flight. Open loop starts one
+    //every 1/rate seconds; conns only caps how many may be in flight,
+    //and requests over the cap wait without their clock stopping.
+    //Replay works like open loop, with the log supplying the schedule.
+    long long start = nowUsec(), end = start + seconds * 1000000LL;
+    long long interval = rate > 0 ? (long long) (1000000 / rate) : 0;
+    long long nextStart = start, backlog = 0, logStart = 0;
+    long long retryAt = 0, errorsBefore = 0, completedBefore = 0;
+    char replayCmd[BUFFER_SIZE];
+    struct accessRecord *pending = NULL;
+    int inFlight = 0, timed = rate > 0 || (replayLog != NULL && speed > 0);
+    if(replayLog != NULL){
+        pending = nextRecord(replayCmd);
+        if(pending != NULL) logStart = pending->timeUsec;
+        end = pending != NULL ? (long long) 1 << 62 : start;
+        printf("Replaying %s, %i connections.\n", speed > 0 ? "on schedule" : "at full speed", conns);
+    }
+    else printf("%s loop, %i connections, %i seconds, %i commands in mix.\n",
+            rate > 0 ? "Open" : "Closed", conns, seconds, mixCount);
+
+    while(1){
+        long long now = nowUsec();
+        if(replayLog != NULL){
+            //Start every logged request whose (scaled) time has come
+            while(pending != NULL && inFlight < conns){
+                long long scheduled = speed > 0
+                    ? start + (long long) ((pending->timeUsec - logStart) / speed) : now;
+                if(scheduled > now){
+                    nextStart = scheduled;
+                    break;
+                }
+                if(startRequest(replayCmd, scheduled) == 0) inFlight++;
+                pending = nextRecord(replayCmd);
+            }
+            if(pending == NULL){
+                end = now;
+                if(inFlight == 0) break;
+            }
+        }
+        else if(now < end){
+            if(rate > 0){
+                while(nextStart <= now){
+                    backlog++;
+                    nextStart += interval;
+                }
+                while(backlog > 0 && inFlight < conns){
+                    long long scheduled = nextStart - backlog * interval;
+                    backlog--;
+                    if(startRequest(pickMix(), scheduled) == 0) inFlight++;
+                }
+            }
+            else if(now >= retryAt){
+                //A request that can't start (refused, out of fds or
+                //ports) is an error; try again after the wait below
+                //rather than spinning
+                while(inFlight < conns && startRequest(pickMix(), now) == 0)
+                    inFlight++;
+            }
+        }
+        else if(inFlight == 0) break;
+
+        int timeout = 100;
+        if(timed && now < end){
+            long long wait = (nextStart - now) / 1000;
+            timeout = wait < 0 ? 0 : wait < 100 ? (int) wait : 100;
+        }
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+        for(i = 0; i < n; i++)
+            if(handleEvent(events[i].data.ptr, events[i].events)) inFlight--;
+
+        //Requests that only fail (nothing listening, say) are retried
+        //RETRY_USEC later, not as fast as the failures come back
+        if(errors > errorsBefore && completed == completedBefore)
+            retryAt = now + RETRY_USEC;
+        errorsBefore = errors;
+        completedBefore = completed;
+
+        //Give up on stragglers well after the run ends
+        if(now > end + 30 * 1000000LL) break;
+    }
+
+    double elapsed = (nowUsec() - start) / 1e6;
+    printf("Completed %lld requests in %.2f s: %.1f req/s, %.2f MB/s received.\n",
+            completed, elapsed, completed / elapsed, bytesReceived / elapsed / 1e6);
+    printf("Errors: %lld, not found: %lld, never started: %lld, still running: %i.\n",
+            errors, notFound, backlog, inFlight);
+    if(hist.total > 0){
+        printf("Latency (usec%s): mean %lld, p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+                timed ? ", from scheduled start" : "",
+                hist.sum / hist.total, histPercentile(&hist, 0.5), histPercentile(&hist, 0.9),
+                histPercentile(&hist, 0.99), histPercentile(&hist, 0.999), hist.max);
+    }
+    freeaddrinfo(server);
+    return errors > 0;
+}
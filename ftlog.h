@@ -0,0 +1,34 @@
+/********************************************************************
+ * ** Program Filename: ftlog.h
+ * ** Description: Layout of the binary access log ftserver.c writes
+ *      (-L) and ftload.c replays (-R). The file starts with the
+ *      8-byte ACCESS_LOG_MAGIC, followed by one accessRecord per
+ *      request, each followed by its command text (nameLen bytes,
+ *      not null-terminated). Fields are in host byte order, except
+ *      the client address.
+ * *********************************************************************/
+#ifndef FTLOG_H
+#define FTLOG_H
+
+#include <stdint.h>
+
+#define ACCESS_LOG_MAGIC "FTLOG\x01\0"
+
+//What kind of request a record is
+enum accessCommand {
+    ACCESS_GET = 0,
+    ACCESS_LIST = 1,
+    ACCESS_OTHER = 2
+};
+
+struct accessRecord {
+    uint64_t timeUsec; //Wall-clock time the request was accepted
+    uint64_t bytes; //File data sent to the client
+    uint32_t latencyUsec; //Accept to data connection closed
+    uint32_t client; //Client's IPv4 address, network byte order
+    uint16_t nameLen; //Length of the command text that follows
+    uint8_t command; //An accessCommand
+    uint8_t reserved;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,604 @@
+/********************************************************************
+ * ** Program Filename: ftproxy.c
+ * ** Description: Network emulation proxy for testing ftserver.c over
+ *      a simulated WAN without root. Sits between a client and the
+ *      server and delays, jitters, rate limits and occasionally stalls
+ *      the traffic on both the control and data connections.
+ *      Since ftserver connects back to the port the client names in
+ *      the message after each command, the proxy rewrites that message
+ *      to name a port of its own, then joins the server's data
+ *      connection to the client's real data port. Control messages are
+ *      split like the server splits them: at NULs or newlines, with
+ *      padding skipped and "-cancel" taking no port.
+ * ** Input: The port to listen on, the server's name and port, plus
+ *      options (each applied per direction, per connection):
+ *          -d ms     one-way delay
+ *          -j ms     delay jitter, uniform in +/- ms (order is kept)
+ *          -b rate   bandwidth cap in bytes/s (K, M, G suffixes)
+ *          -p prob   chance (0-1) that a read chunk is stalled, like a
+ *                    lost packet waiting for retransmission
+ *          -s ms     length of each stall (default 200)
+ * ** Output: Relays traffic; prints a line per connection.
+ * *********************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#define BUFFER_SIZE 500 //Size of every ftserver control message
+#define MAX_EVENTS 256
+#define READ_CHUNK (1 << 16)
+#define MAX_QUEUED (4 << 20) //Bytes buffered per direction before reads pause
+#define DATA_GRACE_USEC 1000000 //How long a data listener outlives its control link
+
+//Bytes read from one side, waiting until they're due at the other
+struct chunk {
+    struct chunk *next;
+    long long due;
+    int len, off;
+    char data[];
+};
+
+//One direction of a link
+struct pipe {
+    struct chunk *head, *tail;
+    long long queued;
+    long long lastDue;
+    double tokens;
+    long long tokenTime;
+    int eof, shut;
+    //Control links only: the client's message so far, and how many
+    //messages other than "-cancel" came before it
+    char frame[BUFFER_SIZE];
+    int frameLen, frameNo;
+};
+
+//One socket. Side 0 faces the client, side 1 faces the server.
+struct sock {
+    int fd;
+    int kind; //0 link socket, 1 client listener, 2 data listener
+    int side;
+    int connected;
+    struct link *link; //Data listeners: the control link, until it closes
+    struct sockaddr_in target; //Data listeners: client's data port
+    long long expires; //Data listeners: when to give up, once unlinked
+    struct sock *next; //Data listeners: the rest of the list
+};
+
+//A proxied connection: two sockets and a pipe each way.
+//pipe[0] carries client to server, pipe[1] server to client.
+struct link {
+    struct sock sock[2];
+    struct pipe pipe[2];
+    int control;
+    int dead; //Closed by service(), so later events in a batch are safe
+    struct link *next, *prev;
+};
+
+struct addrinfo *server;
+struct link *links = NULL;
+struct sock *dataListeners = NULL;
+int epollFD;
+long long delayUsec = 0, jitterUsec = 0, stallUsec = 200000;
+double rate = 0, stallProb = 0;
+
+
+
+/*********************************************************************
+ * ** Function: error
+ * ** Description: Prints a descriptive error message and exits.
+ * ** Parameters: Takes a constant char message
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Will exit the program.
+ * *********************************************************************/
+void error(const char *msg){
+    perror(msg);
+    exit(1);
+}
+
+
+
+/*********************************************************************
+ * ** Function: nowUsec()
+ * ** Description: Returns a monotonic timestamp in microseconds.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the current monotonic time.
+ * *********************************************************************/
+long long nowUsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+/*********************************************************************
+ * ** Function: updateInterest()
+ * ** Description: Sets which epoll events a link socket waits for:
+ *      reads unless its outgoing pipe is full or finished, and writes
+ *      while data for it is due but couldn't be written.
+ * ** Parameters: The socket, whether a write is blocked.
+ * ** Pre-Conditions: The socket must be registered with epoll.
+ * ** Post-Conditions: The socket's interest is updated.
+ * *********************************************************************/
+void updateInterest(struct sock *s, int wantWrite){
+    struct pipe *out = &s->link->pipe[s->side];
+    struct epoll_event ev;
+    ev.events = 0;
+    if(!out->eof && out->queued < MAX_QUEUED && s->connected) ev.events |= EPOLLIN;
+    if(wantWrite || !s->connected) ev.events |= EPOLLOUT;
+    ev.data.ptr = s;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+
+
+/*********************************************************************
+ * ** Function: addSock()
+ * ** Description: Fills in a socket and registers it with epoll.
+ * ** Parameters: The socket struct, its fd, kind, side and link.
+ * ** Pre-Conditions: The fd must be non-blocking.
+ * ** Post-Conditions: epoll will report events for the socket.
+ * *********************************************************************/
+void addSock(struct sock *s, int fd, int kind, int side, struct link *link){
+    struct epoll_event ev;
+    s->fd = fd;
+    s->kind = kind;
+    s->side = side;
+    s->link = link;
+    ev.events = kind == 0 ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = s;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) error("ERROR on epoll_ctl");
+}
+
+
+
+/*********************************************************************
+ * ** Function: newLink()
+ * ** Description: Creates a link between an accepted socket and a
+ *      socket connecting to the other end.
+ * ** Parameters: The fd facing the client, the fd facing the server,
+ *      which of them is still connecting, whether it's a control link.
+ * ** Pre-Conditions: Both fds must be non-blocking.
+ * ** Post-Conditions: Returns the link, added to the list.
+ * *********************************************************************/
+struct link *newLink(int clientFD, int serverFD, int connectingSide, int control){
+    struct link *l = calloc(1, sizeof(*l));
+    long long now = nowUsec();
+    l->control = control;
+    addSock(&l->sock[0], clientFD, 0, 0, l);
+    addSock(&l->sock[1], serverFD, 0, 1, l);
+    l->sock[0].connected = connectingSide != 0;
+    l->sock[1].connected = connectingSide != 1;
+    l->pipe[0].tokenTime = l->pipe[1].tokenTime = now;
+    l->next = links;
+    if(links) links->prev = l;
+    links = l;
+    updateInterest(&l->sock[0], 0);
+    updateInterest(&l->sock[1], 0);
+    return l;
+}
+
+
+
+/*********************************************************************
+ * ** Function: closeLink()
+ * ** Description: Closes both sockets of a link and frees it. Data
+ *      listeners it opened get a short grace period for a server
+ *      that's still connecting back, after which service() closes
+ *      them.
+ * ** Parameters: The link.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The link is gone.
+ * *********************************************************************/
+void closeLink(struct link *l){
+    struct sock *dl;
+    int i;
+    for(dl = dataListeners; dl != NULL; dl = dl->next){
+        if(dl->link == l){
+            dl->link = NULL;
+            dl->expires = nowUsec() + DATA_GRACE_USEC;
+        }
+    }
+    for(i = 0; i < 2; i++){
+        close(l->sock[i].fd);
+        while(l->pipe[i].head){
+            struct chunk *c = l->pipe[i].head;
+            l->pipe[i].head = c->next;
+            free(c);
+        }
+    }
+    if(l->prev) l->prev->next = l->next;
+    else links = l->next;
+    if(l->next) l->next->prev = l->prev;
+    free(l);
+}
+
+
+
+/*********************************************************************
+ * ** Function: enqueue()
+ * ** Description: Queues bytes on a pipe, due after the emulated
+ *      delay, jitter and any stall. Chunks never overtake each other.
+ * ** Parameters: The pipe, the bytes, how many.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The bytes are queued.
+ * *********************************************************************/
+void enqueue(struct pipe *p, const char *data, int len){
+    struct chunk *c = malloc(sizeof(*c) + len);
+    long long due = nowUsec() + delayUsec;
+    if(jitterUsec > 0) due += rand() % (2 * jitterUsec + 1) - jitterUsec;
+    if(stallProb > 0 && rand() < stallProb * RAND_MAX) due += stallUsec;
+    if(due < p->lastDue) due = p->lastDue;
+    p->lastDue = due;
+
+    c->next = NULL;
+    c->due = due;
+    c->len = len;
+    c->off = 0;
+    memcpy(c->data, data, len);
+    if(p->tail) p->tail->next = c;
+    else p->head = c;
+    p->tail = c;
+    p->queued += len;
+}
+
+
+
+/*********************************************************************
+ * ** Function: listenForData()
+ * ** Description: Opens a data listener in place of the client's,
+ *      remembering where the client is really listening.
+ * ** Parameters: The control link, the data port message, which is
+ *      rewritten to name the proxy's port.
+ * ** Pre-Conditions: The link must be a control link.
+ * ** Post-Conditions: Returns the rewritten message's length.
+ * *********************************************************************/
+int listenForData(struct link *l, char *frame){
+    struct sock *dl = calloc(1, sizeof(*dl));
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if(fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0
+            || getsockname(fd, (struct sockaddr *) &addr, &addrLen) < 0)
+        error("ERROR opening data listener");
+
+    //The client listens on the port it named, at its own address
+    addrLen = sizeof(dl->target);
+    getpeername(l->sock[0].fd, (struct sockaddr *) &dl->target, &addrLen);
+    dl->target.sin_port = htons(atoi(frame));
+    addSock(dl, fd, 2, 0, l);
+    dl->next = dataListeners;
+    dataListeners = dl;
+    return snprintf(frame, BUFFER_SIZE, "%i", ntohs(addr.sin_port));
+}
+
+
+
+/*********************************************************************
+ * ** Function: closeDataListener()
+ * ** Description: Takes a data listener off the list, closes it and
+ *      frees it.
+ * ** Parameters: The data listener.
+ * ** Pre-Conditions: It must be on the list.
+ * ** Post-Conditions: The listener is gone.
+ * *********************************************************************/
+void closeDataListener(struct sock *dl){
+    struct sock **at = &dataListeners;
+    while(*at != dl) at = &(*at)->next;
+    *at = dl->next;
+    close(dl->fd);
+    free(dl);
+}
+
+
+
+/*********************************************************************
+ * ** Function: frameControl()
+ * ** Description: Passes client-to-server control bytes through
+ *      message by message, splitting them where the server does: at
+ *      each NUL or newline, with the padding between messages passed
+ *      on as it is. The message after each command is a data port,
+ *      which listenForData() replaces; "-cancel" isn't a command and
+ *      is followed by none. A message is held back until it's
+ *      complete.
+ * ** Parameters: The control link, the bytes read from the client,
+ *      how many.
+ * ** Pre-Conditions: The link must be a control link.
+ * ** Post-Conditions: Complete messages and padding are queued for
+ *      the server.
+ * *********************************************************************/
+void frameControl(struct link *l, const char *data, int len){
+    struct pipe *p = &l->pipe[0];
+    //A rewritten port is at most 5 digits, for a message of 2 bytes
+    char *out = malloc(3 * len + BUFFER_SIZE), *o = out;
+    int i;
+
+    for(i = 0; i < len; i++){
+        if(data[i] != '\0' && data[i] != '\n'){
+            p->frame[p->frameLen++] = data[i];
+            //Too long for the server, which drops the connection
+            if(p->frameLen == BUFFER_SIZE - 1){
+                memcpy(o, p->frame, p->frameLen);
+                o += p->frameLen;
+                p->frameLen = 0;
+            }
+            continue;
+        }
+        if(p->frameLen > 0){
+            p->frame[p->frameLen] = '\0';
+            if(strcmp(p->frame, "-cancel") != 0 && p->frameNo++ % 2 == 1)
+                p->frameLen = listenForData(l, p->frame);
+            memcpy(o, p->frame, p->frameLen);
+            o += p->frameLen;
+            p->frameLen = 0;
+        }
+        *o++ = data[i];
+    }
+    if(o > out) enqueue(p, out, o - out);
+    free(out);
+}
+
+
+
+/*********************************************************************
+ * ** Function: flushPipe()
+ * ** Description: Writes whatever is due on a pipe, within the
+ *      bandwidth cap, and passes EOF on once the pipe is empty.
+ * ** Parameters: The link, which pipe.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 1 if a write would block, -1 if the
+ *      link failed, 0 otherwise.
+ * *********************************************************************/
+int flushPipe(struct link *l, int dir){
+    struct pipe *p = &l->pipe[dir];
+    struct sock *to = &l->sock[1 - dir];
+    long long now = nowUsec();
+
+    if(rate > 0){
+        double burst = rate / 100 > 16384 ? rate / 100 : 16384;
+        p->tokens += (now - p->tokenTime) * rate / 1e6;
+        if(p->tokens > burst) p->tokens = burst;
+        p->tokenTime = now;
+    }
+    while(p->head != NULL && p->head->due <= now && to->connected){
+        struct chunk *c = p->head;
+        int want = c->len - c->off;
+        if(rate > 0){
+            if(p->tokens < 1) break;
+            if(want > p->tokens) want = (int) p->tokens;
+        }
+        int n = write(to->fd, c->data + c->off, want);
+        if(n < 0 && errno == EAGAIN) return 1;
+        if(n < 0) return -1;
+        c->off += n;
+        p->queued -= n;
+        if(rate > 0) p->tokens -= n;
+        if(c->off == c->len){
+            p->head = c->next;
+            if(p->head == NULL) p->tail = NULL;
+            free(c);
+        }
+    }
+    if(p->head == NULL && p->eof && !p->shut && to->connected){
+        shutdown(to->fd, SHUT_WR);
+        p->shut = 1;
+    }
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: service()
+ * ** Description: Flushes both pipes of every link, closes data
+ *      listeners whose control link is long gone, and works out how
+ *      long until something else falls due.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns an epoll timeout in milliseconds.
+ * *********************************************************************/
+int service(){
+    long long now = nowUsec(), next = now + 1000000;
+    struct link *l = links;
+    struct sock *dl = dataListeners;
+    int i;
+
+    while(dl != NULL){
+        //The server never connected back, e.g. after "nof"
+        struct sock *following = dl->next;
+        if(dl->link == NULL && dl->expires <= now) closeDataListener(dl);
+        else if(dl->link == NULL && dl->expires < next) next = dl->expires;
+        dl = following;
+    }
+
+    while(l != NULL){
+        struct link *following = l->next;
+        int failed = 0;
+        for(i = 0; i < 2 && !failed && !l->dead; i++){
+            int blocked = flushPipe(l, i);
+            if(blocked < 0) failed = 1;
+            else {
+                updateInterest(&l->sock[1 - i], blocked);
+                struct pipe *p = &l->pipe[i];
+                if(p->head != NULL && !blocked){
+                    long long due = p->head->due;
+                    if(rate > 0 && p->tokens < 1) due = now + (long long) ((1 - p->tokens) * 1e6 / rate) + 1;
+                    if(due < next) next = due;
+                }
+            }
+        }
+        if(failed || l->dead || (l->pipe[0].shut && l->pipe[1].shut)) closeLink(l);
+        l = following;
+    }
+    long long wait = (next - nowUsec() + 999) / 1000;
+    return wait < 0 ? 0 : (int) wait;
+}
+
+
+
+/*********************************************************************
+ * ** Function: handleEvent()
+ * ** Description: Accepts new client connections and data
+ *      connections from the server, completes connects, and reads
+ *      incoming bytes onto the matching pipe.
+ * ** Parameters: The socket that fired, the events reported.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: New links are created or data is queued.
+ * *********************************************************************/
+void handleEvent(struct sock *s, int events){
+    static char data[READ_CHUNK];
+
+    if(s->kind == 1){
+        //New client: connect onward to the server
+        int clientFD = accept4(s->fd, NULL, NULL, SOCK_NONBLOCK);
+        if(clientFD < 0) return;
+        int serverFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(connect(serverFD, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS){
+            close(clientFD);
+            close(serverFD);
+            return;
+        }
+        printf("Control connection.\n");
+        newLink(clientFD, serverFD, 1, 1);
+        return;
+    }
+    if(s->kind == 2){
+        //Server connecting back: join it to the client's data port
+        int serverFD = accept4(s->fd, NULL, NULL, SOCK_NONBLOCK);
+        if(serverFD < 0) return;
+        int clientFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(connect(clientFD, (struct sockaddr *) &s->target, sizeof(s->target)) < 0 && errno != EINPROGRESS){
+            close(clientFD);
+            close(serverFD);
+        }
+        else {
+            printf("Data connection to client port %i.\n", ntohs(s->target.sin_port));
+            newLink(clientFD, serverFD, 0, 0);
+        }
+        closeDataListener(s);
+        return;
+    }
+
+    struct link *l = s->link;
+    if(l->dead) return;
+    if(!s->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0){
+            l->dead = 1;
+            return;
+        }
+        s->connected = 1;
+    }
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        struct pipe *p = &l->pipe[s->side];
+        while(!p->eof && p->queued < MAX_QUEUED){
+            int n = read(s->fd, data, sizeof(data));
+            if(n < 0 && errno == EAGAIN) break;
+            if(n <= 0){
+                p->eof = 1;
+                break;
+            }
+            if(l->control && s->side == 0) frameControl(l, data, n);
+            else enqueue(p, data, n);
+        }
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: parseSize()
+ * ** Description: Parses a byte count with an optional K, M or G
+ *      suffix.
+ * ** Parameters: The string to parse.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the number of bytes.
+ * *********************************************************************/
+double parseSize(const char *str){
+    char *end;
+    double n = strtod(str, &end);
+    switch(*end){
+        case 'g': case 'G': n *= 1024; //fall through
+        case 'm': case 'M': n *= 1024; //fall through
+        case 'k': case 'K': n *= 1024;
+    }
+    return n;
+}
+
+
+
+/*MAIN*/
+int main(int argc, char *argv[]){
+    struct epoll_event events[MAX_EVENTS];
+    struct addrinfo hints;
+    struct sockaddr_in addr;
+    struct sock listener;
+    int opt, i, one = 1;
+    const char *usage = "usage: ./ftproxy [-d ms] [-j ms] [-b bytesPerSec] [-p stallProb] [-s stallMs]"
+        " listenPort serverHost serverPort\n";
+
+    while((opt = getopt(argc, argv, "d:j:b:p:s:")) != -1){
+        switch(opt){
+            case 'd': delayUsec = atof(optarg) * 1000; break;
+            case 'j': jitterUsec = atof(optarg) * 1000; break;
+            case 'b': rate = parseSize(optarg); break;
+            case 'p': stallProb = atof(optarg); break;
+            case 's': stallUsec = atof(optarg) * 1000; break;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
+    if(argc - optind != 3){
+        printf("%s", usage);
+        exit(1);
+    }
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &server) != 0){
+        fprintf(stderr, "ERROR, unknown server %s\n", argv[optind + 1]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    epollFD = epoll_create1(0);
+    if(epollFD < 0) error("ERROR creating epoll");
+
+    int listenFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(atoi(argv[optind]));
+    if(bind(listenFD, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenFD, SOMAXCONN) < 0)
+        error("ERROR on binding");
+    bzero(&listener, sizeof(listener));
+    addSock(&listener, listenFD, 1, 0, NULL);
+    printf("Proxying port %s to %s:%s: delay %lld us, jitter %lld us, rate %.0f B/s, stalls %.3f x %lld us.\n",
+            argv[optind], argv[optind + 1], argv[optind + 2], delayUsec, jitterUsec, rate, stallProb, stallUsec);
+    fflush(stdout);
+
+    while(1){
+        int timeout = service();
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+        for(i = 0; i < n; i++)
+            handleEvent(events[i].data.ptr, events[i].events);
+    }
+    return 0;
+}
@@ -15,6 +15,7 @@
  *      header blocks.
  * *********************************************************************/
 
+#define _GNU_SOURCE //for copy_file_range()
 #include <stdio.h> //input/output
 #include <stdlib.h>
 #include <string.h>
@@ -24,7 +25,235 @@
 #include <netinet/in.h> //constants and structs needed for internet domain addrs
 #include <netdb.h>
 #include <dirent.h> //for getting current directory contents
+#include <fcntl.h> //open() flags
+#include <errno.h>
+#include <limits.h> //NAME_MAX for batch stat names, PATH_MAX
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h> //inet_ntop() for logging peers
+#include <sys/file.h> //flock() for cache entry locks
+#include <sys/inotify.h> //change stream for replication
+#include <sys/mman.h> //metrics shared between server processes
+#include <sys/wait.h>
+#include <signal.h>
+#include <semaphore.h> //bulk slots shared by server processes
+#include <malloc.h> //mallinfo2() for allocator stats in metrics
+#include <sched.h> //CPU pinning for steered workers
+#include <linux/filter.h> //reuseport program for steered workers
+#include <ucontext.h> //coroutines for the event-driven mode
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h> //bulk processes stop with their server
+#ifdef __SSE2__
+#include <emmintrin.h> //delimiter scan in the command reader
+#endif
+#include "ftlog.h" //access log record layout
 const int BUFFER_SIZE = 500;
+#define MAX_ARGS 32 //Most words accepted in one server-side command
+#define TOKEN_LEN 32 //Hex characters in a one-time push token
+#define PUSH_TIMEOUT 30 //Seconds a receiving server waits for its pusher
+#define PUSH_CHUNK (1 << 20) //Bytes sent between progress checks
+#define RECV_CHUNK (1 << 16) //Read size when receiving file data
+#define HASH_MEMOS 256 //Remembered file hashes for the stat command
+#define MAX_FOLLOW_JOBS 64 //Upper limit for -j
+#define MAX_NAME 256 //Longest file name a follower replicates, plus 1
+#define REPL_RETRY_MS 100 //First wait before a failed fetch is retried
+#define REPL_RETRY_MAX_MS 30000 //Longest wait between retries
+#define MAX_WORKERS 256 //Upper limit for -w
+#define CO_STACK_SIZE (128 << 10) //Stack per coroutine, plus a guard page
+#define CO_POOL_MAX 4096 //Idle coroutine stacks kept for reuse
+#define MAX_EVENTS 256 //epoll events handled per wakeup
+#define READER_SIZE 4096 //Control bytes buffered per connection
+#define RANK_LEVELS 16 //Skip list levels in the size and mtime indexes
+#define MAX_ROOTS 16 //Served directories, the default one included
+#define ROOT_NAME 32 //Longest root name, plus 1
+#define BULK_SLICE (256 << 10) //Bytes a bulk session sends between yields
+#define LATE_SAMPLE_USEC 100000 //Transfer time before its rate is trusted
+#define CANCEL_CHECK (64 << 10) //Bytes sent between looks for "-cancel"
+#define BULK_QUEUE 64 //Bulk processes that may wait beyond the slots
+
+//Relay mode settings, set from the command line. When upstreamHost
+//is set the server fronts another ftserver's default root with a
+//local disk cache, whose path main() makes absolute.
+char *upstreamHost = NULL;
+char *upstreamPort = NULL;
+char *cacheDir = "ftcache";
+long long cacheMax = 1LL << 30;
+
+//Follower mode settings. When leaderHost is set a replication process
+//keeps the served directory in sync with the leader ftserver.
+char *leaderHost = NULL;
+char *leaderPort = NULL;
+int followJobs = 4;
+
+//Worker settings (-w, -S). With more than one worker each has its own
+//SO_REUSEPORT listener. With steering, worker i is pinned to every CPU
+//c with c % workers == i, and the kernel gives each connection to the
+//worker pinned to the CPU that received its packets.
+int workers = 1;
+int steerCPU = 0;
+
+//Busy-poll settings (-B usec[,budget]). When busyPollUsec is set the
+//accept loop spins that long before sleeping, and sockets ask the
+//kernel to busy-poll the device queue instead of waiting for an
+//interrupt.
+int busyPollUsec = 0;
+int busyPollBudget = 0;
+
+//Traffic classes (-b slots[,size]). Bulk requests (files of at least
+//bulkThreshold bytes, probes that big, uploads, pushes, or anything
+//the client marks "+bulk ") run at most bulkSlots at a time, queued
+//for a slot, so interactive requests always have capacity. In the
+//blocking modes each bulk request gets its own process, and the slots
+//are shared by every server process; at most BULK_QUEUE of those
+//processes wait beyond the slots, and further bulk requests are
+//refused. In event-driven mode the slots are per process and
+//interactive sessions run ahead of bulk ones.
+enum { CLASS_INTERACTIVE, CLASS_BULK, CLASSES };
+int bulkSlots = 0;
+long long bulkThreshold = 1 << 20;
+
+//The control connection of the request being served, watched for a
+//"-cancel" from the client while data goes out on dataFD (see
+//cancelRequested()). controlFD is -1 when nothing is watched.
+struct cancelWatch {
+    int controlFD, dataFD;
+    struct cmdReader *reader;
+    long long unchecked; //Bytes sent since the last look
+    int cancelled;
+};
+struct cancelWatch watch = { -1, -1, NULL, 0, 0 };
+
+//Event-driven mode (-E). Every connection runs as a coroutine on its
+//own small stack; the io*() wrappers below yield to the epoll loop
+//whenever a socket would block, so request handlers stay sequential.
+struct coroutine {
+    ucontext_t ctx;
+    char *stack;
+    void (*func)(void *);
+    void *arg;
+    int done;
+    long long bytesSent; //This session's view of bytesSentHere
+    struct servedRoot *root; //Directory this session is working in
+    int cls; //Traffic class of the current request
+    long long unyielded; //Bulk bytes sent since the last yield
+    long long deadline; //This session's view of requestDeadline
+    int expired; //Dropped from the bulk queue by its deadline
+    int waitFD; //Socket it's waiting on in coWaitUntil() with a time limit...
+    long long waitUntil; //...the limit (nowUsec() time)...
+    struct coroutine *timedPrev, *timedNext; //...and the timed wait list
+    struct cancelWatch watch; //This session's view of watch
+    int queued; //On a run queue
+    struct coroutine *next; //Run queue or bulk wait link
+};
+int eventMode = 0;
+int epollFD = -1;
+struct coroutine *currentCo = NULL;
+struct coroutine *runHead[CLASSES], *runTail[CLASSES];
+int runCount = 0;
+int bulkFree = 0; //Event-driven mode's free bulk slots...
+struct coroutine *bulkWaitHead = NULL, *bulkWaitTail = NULL; //...and waiters
+struct coroutine *timedHead = NULL; //Waiting in coWaitUntil() with a limit
+ucontext_t schedulerCtx;
+char *stackPool[CO_POOL_MAX];
+int stackPoolCount = 0;
+long long liveSessions = 0;
+
+//Counters shared by every server process, see initMetrics()
+struct serverMetrics {
+    long long requests;
+    long long bytesSent;
+    long long replConnected;
+    long long replLagMs;
+    long long replPending;
+    long long replFiles;
+    long long replBytes;
+    long long replDeltaSaved;
+    long long accepts; //Connections whose receiving CPU was known
+    long long crossCPUAccepts; //...and were served on another CPU
+    long long rootActive[MAX_ROOTS]; //Requests in flight per root
+    long long rootRefused[MAX_ROOTS]; //...and turned away by its quota
+    long long classRequests[CLASSES];
+    long long bulkWaiting; //Bulk requests queued for a slot
+    long long bulkActive;
+    long long bulkProcesses; //Forked bulk processes, blocking modes
+    sem_t bulkSem; //Free bulk slots, in the blocking modes
+    long long expiredQueued; //Requests dropped by deadline before starting
+    long long expiredAborted; //...and cut off part way
+    long long cancelled; //Transfers stopped by "-cancel"
+};
+struct serverMetrics *metrics;
+
+//Set by SIGINT or SIGTERM; the accept loop then exits normally
+volatile sig_atomic_t stopping = 0;
+
+//This process's listening socket, which forked bulk processes close
+int serverListenFD = -1;
+
+//Access log (-L), and the file bytes this process has sent so far
+int accessLogFD = -1;
+long long bytesSentHere = 0;
+
+//Deadline of the request being served (nowUsec() time), from its
+//"@" prefix: 0 for none, -1 once the request has been cut off for
+//missing it. Writes fail from then on, see ioWrite().
+long long requestDeadline = 0;
+
+//File hashes computed for "-s", remembered per name and version
+struct hashMemo {
+    char name[256];
+    long long size;
+    long long mtime;
+    unsigned long long hash;
+};
+
+//Metadata of every entry in the served directory, hashed by name and
+//kept current from inotify events, so lookups don't touch the disk.
+//Built on first use in each server process, see indexSync().
+//Regular files are also kept in two skip lists, largest and newest
+//first, for the "-top" and "-range" queries.
+enum { RANK_SIZE, RANK_MTIME, RANKS };
+struct rankNode {
+    struct dirEntry *entry; //NULL in a list's head
+    int levels;
+    struct rankNode *next[];
+};
+struct dirEntry {
+    struct dirEntry *next; //Hash chain
+    struct rankNode *rank[RANKS]; //NULL unless a regular file
+    long long size;
+    long long mtime; //Nanoseconds
+    char type; //'f' regular file, 'd' directory, 'o' anything else
+    char link; //Symlink: the target can change unseen, so always re-stat
+    char name[];
+};
+struct dirIndex {
+    int watchFD; //-1 until built
+    struct dirEntry **buckets;
+    long numBuckets;
+    long count;
+    struct rankNode *rankHead[RANKS];
+    long maxEntries; //Entries allowed, 0 for no limit
+    int overBudget; //Directory outgrew maxEntries; lookups use stat()
+};
+
+//Served directories (-R). Root 0, "default", is the directory the
+//server started in. A request names another with a "/name " prefix,
+//and is then served inside that root's directory (see selectRoot()).
+//Each root has its own index and hash memos, and optionally caps on
+//requests in flight (over all server processes) and indexed entries.
+struct servedRoot {
+    char name[ROOT_NAME];
+    int dirFD;
+    int quota; //0 for no limit
+    struct dirIndex index;
+    struct hashMemo hashMemos[HASH_MEMOS];
+};
+struct servedRoot roots[MAX_ROOTS] = { { .name = "default", .dirFD = -1, .index.watchFD = -1 } };
+int numRoots = 1;
+struct servedRoot *cwdRoot = &roots[0]; //The one this process is in
 
 
 
@@ -86,61 +315,804 @@ void startUp(int portNum, struct sockaddr_in *servAddr, int sockFD){
     servAddr->sin_addr.s_addr = INADDR_ANY;
     servAddr->sin_port = htons(portNum);
 
+    //Allow restarting right after a shutdown, while old connections
+    //are still in TIME_WAIT, and workers sharing the port
+    int on = 1;
+    setsockopt(sockFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(workers > 1 && setsockopt(sockFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        error("ERROR setting SO_REUSEPORT");
+
     //Bind the socket to the host address and port number
     if(bind(sockFD,(struct sockaddr *) servAddr, sizeof(*servAddr)) < 0)
         error("ERROR on binding");
 
     //Start listening for connections
-    listen(sockFD,5);
+    listen(sockFD,SOMAXCONN);
     printf("Server open and listening on port %i.\n", portNum);
 }
 
 
 
 /*********************************************************************
- * ** Function: sendMsg()
- * ** Description: Sends messages to the client over the specified
- *      socket. Terminates if there's an error writing to the socket.
- * ** Parameters: A socket file descriptor (for the socket
- *      over which the message will be sent), a pointer to a
- *      const char message to be sent.
- * ** Pre-Conditions: The connection file descriptor must be associated
- *      with an open socket. The char array must be malloc'd.
- * ** Post-Conditions: The message will be sent to a connected client.
+ * ** Function: stackAlloc()
+ * ** Description: Returns a coroutine stack, reusing a pooled one if
+ *      there is one. Fresh stacks are mapped with a guard page below
+ *      them so an overflow faults instead of corrupting a neighbour.
+ *      Pages are only backed by memory once touched.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the lowest usable address of a
+ *      CO_STACK_SIZE stack, or NULL if memory ran out.
  * *********************************************************************/
-void sendMsg(int socketFD, char *buffer, const char *msg){
-    //Write to the socket
-    bzero(buffer, BUFFER_SIZE);
-    strcpy(buffer, msg);
-    int success = write(socketFD, buffer, BUFFER_SIZE);
-    if(success < 0)
-        error("ERROR writing message to socket.");
+char *stackAlloc(){
+    long page = sysconf(_SC_PAGESIZE);
+    char *base;
+
+    if(stackPoolCount > 0)
+        return stackPool[--stackPoolCount];
+    base = mmap(NULL, CO_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) return NULL;
+    mprotect(base, page, PROT_NONE);
+    return base + page;
 }
 
 
 
 /*********************************************************************
- * ** Function: recMsg()
- * ** Description: Reads messages from the socket for handling.
- *      Function does its own error checking and terminates the
- *      program if there's an error.
- * ** Parameters: A pointer to a char array, a file descriptor
- *      for the communication socket.
- * ** Pre-Conditions: There is an active socket connection and a
- *      char array has been malloc'd in main.
- * ** Post-Conditions: The message will be available for use by other
- *      functions like handleRequest. If an error occurs, the program
- *      will terminate.
+ * ** Function: stackFree()
+ * ** Description: Returns a stack to the pool, or unmaps it if the
+ *      pool is full.
+ * ** Parameters: A stack from stackAlloc().
+ * ** Pre-Conditions: No coroutine is running on the stack.
+ * ** Post-Conditions: The stack is pooled or released.
  * *********************************************************************/
-void recMsg(char *buffer, int socketFD){
-    //Zero out the buffer
-    bzero(buffer, BUFFER_SIZE);
+void stackFree(char *stack){
+    long page = sysconf(_SC_PAGESIZE);
 
-    //Read from the socket
-    int n = read(socketFD, buffer, BUFFER_SIZE);
+    if(stackPoolCount < CO_POOL_MAX)
+        stackPool[stackPoolCount++] = stack;
+    else
+        munmap(stack - page, CO_STACK_SIZE + page);
+}
 
-    //Check for success
-    if(n < 0) error ("ERROR reading from socket");
+
+
+/*********************************************************************
+ * ** Function: coMain()
+ * ** Description: Entry point of every coroutine: runs its function,
+ *      marks it finished and switches back to the scheduler for good.
+ * ** Parameters: None; the coroutine is currentCo.
+ * ** Pre-Conditions: Started by coResume().
+ * ** Post-Conditions: Never returns.
+ * *********************************************************************/
+void coMain(){
+    struct coroutine *co = currentCo;
+
+    co->func(co->arg);
+    co->done = 1;
+    setcontext(&schedulerCtx);
+}
+
+
+
+/*********************************************************************
+ * ** Function: coQueue()
+ * ** Description: Makes a coroutine runnable, at the back of its
+ *      traffic class's run queue. A coroutine waiting on two sockets
+ *      may be woken by both at once; the second wakeup is dropped.
+ * ** Parameters: The coroutine.
+ * ** Pre-Conditions: It isn't waiting for a bulk slot.
+ * ** Post-Conditions: The scheduler will resume it.
+ * *********************************************************************/
+void coQueue(struct coroutine *co){
+    if(co->queued) return;
+    co->queued = 1;
+    co->next = NULL;
+    if(runTail[co->cls]) runTail[co->cls]->next = co;
+    else runHead[co->cls] = co;
+    runTail[co->cls] = co;
+    runCount++;
+}
+
+
+
+/*********************************************************************
+ * ** Function: coNext()
+ * ** Description: Takes the next coroutine to run: interactive ones
+ *      before any bulk one.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the coroutine, or NULL if none is
+ *      runnable.
+ * *********************************************************************/
+struct coroutine *coNext(){
+    int c;
+
+    for(c = 0; c < CLASSES; c++){
+        struct coroutine *co = runHead[c];
+        if(co == NULL) continue;
+        runHead[c] = co->next;
+        if(runHead[c] == NULL) runTail[c] = NULL;
+        co->next = NULL;
+        co->queued = 0;
+        runCount--;
+        return co;
+    }
+    return NULL;
+}
+
+
+
+/*********************************************************************
+ * ** Function: coYield()
+ * ** Description: Lets every other runnable coroutine go first, for
+ *      sessions that could otherwise run for long without waiting.
+ * ** Parameters: None
+ * ** Pre-Conditions: Called from a coroutine.
+ * ** Post-Conditions: Returns on a later scheduler pass.
+ * *********************************************************************/
+void coYield(){
+    coQueue(currentCo);
+    swapcontext(&currentCo->ctx, &schedulerCtx);
+}
+
+
+
+/*********************************************************************
+ * ** Function: coSpawn()
+ * ** Description: Creates a coroutine that will run func(arg) and
+ *      queues it to run.
+ * ** Parameters: The function, its argument.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0, or -1 if no stack was available.
+ * *********************************************************************/
+int coSpawn(void (*func)(void *), void *arg){
+    struct coroutine *co = calloc(1, sizeof(*co));
+
+    if(co == NULL || (co->stack = stackAlloc()) == NULL){
+        free(co);
+        return -1;
+    }
+    co->func = func;
+    co->arg = arg;
+    co->watch.controlFD = co->watch.dataFD = -1;
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, coMain, 0);
+    coQueue(co);
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: selectRoot()
+ * ** Description: Moves the process into a root's directory, so the
+ *      relative names every handler uses resolve inside it. In
+ *      event-driven mode the root is also remembered for the running
+ *      coroutine, which coResume() moves back into.
+ * ** Parameters: The root.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: cwdRoot is root. Returns 0, or -1 if the
+ *      directory couldn't be entered.
+ * *********************************************************************/
+int selectRoot(struct servedRoot *root){
+    if(currentCo != NULL) currentCo->root = root;
+    if(root == cwdRoot) return 0;
+    if(root->dirFD >= 0 && fchdir(root->dirFD) < 0){
+        perror("ERROR entering root directory");
+        return -1;
+    }
+    cwdRoot = root;
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: coResume()
+ * ** Description: Runs a coroutine until it waits, yields or
+ *      finishes. Its bytesSentHere, requestDeadline and watch are
+ *      swapped in and out so they stay per session, and the process
+ *      moves into its root's directory. Finished coroutines are freed.
+ * ** Parameters: The coroutine.
+ * ** Pre-Conditions: Called from the scheduler, not a coroutine.
+ * ** Post-Conditions: The coroutine is suspended or gone.
+ * *********************************************************************/
+void coResume(struct coroutine *co){
+    long long schedulerBytes = bytesSentHere;
+    struct cancelWatch schedulerWatch = watch;
+
+    currentCo = co;
+    bytesSentHere = co->bytesSent;
+    requestDeadline = co->deadline;
+    watch = co->watch;
+    if(co->root != NULL) selectRoot(co->root);
+    swapcontext(&schedulerCtx, &co->ctx);
+    co->bytesSent = bytesSentHere;
+    co->deadline = requestDeadline;
+    co->watch = watch;
+    bytesSentHere = schedulerBytes;
+    requestDeadline = 0;
+    watch = schedulerWatch;
+    currentCo = NULL;
+    if(co->done){
+        stackFree(co->stack);
+        free(co);
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: nowUsec()
+ * ** Description: Returns a monotonic timestamp in microseconds, used
+ *      to time transfers.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the current monotonic time.
+ * *********************************************************************/
+long long nowUsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+/*********************************************************************
+ * ** Function: deadlinePassed()
+ * ** Description: Checks the request's deadline, marking the request
+ *      as cut off once it has passed.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 1, with requestDeadline -1 and errno
+ *      ETIMEDOUT, if the request has a deadline that has passed;
+ *      otherwise 0.
+ * *********************************************************************/
+int deadlinePassed(){
+    if(requestDeadline == 0 || (requestDeadline > 0 && nowUsec() <= requestDeadline))
+        return 0;
+    requestDeadline = -1;
+    errno = ETIMEDOUT;
+    return 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: coWaitUntil()
+ * ** Description: Suspends the running coroutine until fd is ready
+ *      for the given epoll events. The fd is armed one-shot, so it
+ *      is never reported again until someone waits on it again. If
+ *      there's a time limit, or the request has a deadline, the
+ *      coroutine also goes on the timed wait list, and timedExpire()
+ *      wakes it at the earlier of the two.
+ * ** Parameters: The file descriptor, EPOLLIN or EPOLLOUT, the time
+ *      limit (nowUsec() time, 0 for none).
+ * ** Pre-Conditions: Called from a coroutine.
+ * ** Post-Conditions: Returns once the fd is ready (or has an error,
+ *      which the caller's retried operation will report), or the
+ *      limit or deadline has passed.
+ * *********************************************************************/
+void coWaitUntil(int fd, int events, long long until){
+    struct coroutine *co = currentCo;
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = co;
+    if(epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &ev) < 0
+            && epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0){
+        perror("ERROR waiting on socket");
+        return;
+    }
+    if(requestDeadline > 0 && (until == 0 || requestDeadline < until))
+        until = requestDeadline;
+    if(until > 0){
+        co->waitFD = fd;
+        co->waitUntil = until;
+        co->timedPrev = NULL;
+        co->timedNext = timedHead;
+        if(timedHead) timedHead->timedPrev = co;
+        timedHead = co;
+    }
+    swapcontext(&co->ctx, &schedulerCtx);
+    if(co->timedPrev != NULL || timedHead == co){
+        if(co->timedPrev) co->timedPrev->timedNext = co->timedNext;
+        else timedHead = co->timedNext;
+        if(co->timedNext) co->timedNext->timedPrev = co->timedPrev;
+        co->timedPrev = co->timedNext = NULL;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: coWait()
+ * ** Description: coWaitUntil() with no limit but the request's
+ *      deadline.
+ * ** Parameters: The file descriptor, EPOLLIN or EPOLLOUT.
+ * ** Pre-Conditions: Called from a coroutine.
+ * ** Post-Conditions: As coWaitUntil().
+ * *********************************************************************/
+void coWait(int fd, int events){
+    coWaitUntil(fd, events, 0);
+}
+
+
+
+/*********************************************************************
+ * ** Function: ioReadWithin()
+ * ** Description: read() for sockets that may be non-blocking. In a
+ *      coroutine, a read that would block waits for the socket, up
+ *      to the given number of seconds, and retries; otherwise it
+ *      behaves like read() (blocking sockets get their time limit
+ *      from SO_RCVTIMEO).
+ * ** Parameters: As read(), plus the most seconds to wait for data
+ *      (0 for no limit).
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: As read(), but never fails with EAGAIN inside
+ *      a coroutine. A coroutine's wait fails with ETIMEDOUT at the
+ *      time limit or the request's deadline.
+ * *********************************************************************/
+ssize_t ioReadWithin(int fd, void *buf, size_t len, int seconds){
+    long long until = seconds > 0 ? nowUsec() + seconds * 1000000LL : 0;
+
+    while(1){
+        ssize_t n = read(fd, buf, len);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && currentCo != NULL){
+            if(deadlinePassed()) return -1;
+            if(until > 0 && nowUsec() >= until){
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            coWaitUntil(fd, EPOLLIN, until);
+            continue;
+        }
+        return n;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: ioRead()
+ * ** Description: ioReadWithin() with no time limit.
+ * ** Parameters: As read().
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: As ioReadWithin().
+ * *********************************************************************/
+ssize_t ioRead(int fd, void *buf, size_t len){
+    return ioReadWithin(fd, buf, len, 0);
+}
+
+
+
+//Per-connection command reader. Control messages end at a NUL or a
+//newline, so ftclient.py's NUL padded 500 byte frames, bare
+//newline terminated commands and several commands in one write all
+//parse the same way. [head, tail) holds unparsed bytes; [head, scan)
+//is the start of a message already known to hold no delimiter.
+struct cmdReader {
+    char buf[READER_SIZE];
+    int head, scan, tail;
+};
+
+
+
+/*********************************************************************
+ * ** Function: scanDelims()
+ * ** Description: Finds the first delimiter (NUL or newline) in a
+ *      run of bytes, or with want == 0 the first byte that isn't one.
+ *      Sixteen bytes are compared per step with SSE2 where the
+ *      compiler targets it.
+ * ** Parameters: The bytes, their length, 1 to find a delimiter or 0
+ *      to skip delimiters.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the offset found, or -1 if there's none.
+ * *********************************************************************/
+int scanDelims(const char *p, int len, int want){
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i nul = _mm_setzero_si128(), nl = _mm_set1_epi8('\n');
+    for(; i + 16 <= len; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, nl)));
+        if(!want) mask ^= 0xFFFF;
+        if(mask != 0) return i + __builtin_ctz(mask);
+    }
+#endif
+    for(; i < len; i++)
+        if((p[i] == '\0' || p[i] == '\n') == want) return i;
+    return -1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: nextMessage()
+ * ** Description: Returns the next message from the control
+ *      connection, reading more only when the buffered bytes don't
+ *      hold a whole one. The delimiter is overwritten with a NUL in
+ *      place, so the message is handed out without a copy. Padding
+ *      and empty lines between messages are skipped.
+ * ** Parameters: The connection's reader, the control connection's
+ *      file descriptor.
+ * ** Pre-Conditions: The reader was compacted (see readerCompact())
+ *      at the start of the current request.
+ * ** Post-Conditions: Returns the message, which stays valid until
+ *      the next readerCompact(), or NULL if the connection ended,
+ *      failed or sent a message of BUFFER_SIZE bytes or more.
+ * *********************************************************************/
+char *nextMessage(struct cmdReader *r, int socketFD){
+    char *msg;
+    int n;
+
+    while(1){
+        //Skip padding, unless a message is already partly read
+        if(r->scan == r->head){
+            n = scanDelims(r->buf + r->head, r->tail - r->head, 0);
+            r->head = r->scan = n < 0 ? r->tail : r->head + n;
+        }
+
+        //Look for the end of the message in the bytes not yet scanned
+        n = scanDelims(r->buf + r->scan, r->tail - r->scan, 1);
+        if(n >= 0 && r->scan + n - r->head < BUFFER_SIZE){
+            msg = r->buf + r->head;
+            msg[r->scan + n - r->head] = '\0';
+            r->head = r->scan = r->scan + n + 1;
+            return msg;
+        }
+        r->scan = r->tail;
+        if(n >= 0 || r->tail - r->head >= BUFFER_SIZE || r->tail == READER_SIZE){
+            fprintf(stderr, "ERROR, control message too long\n");
+            return NULL;
+        }
+
+        n = ioRead(socketFD, r->buf + r->tail, READER_SIZE - r->tail);
+        if(n < 0) perror("ERROR reading from socket");
+        if(n <= 0) return NULL;
+        r->tail += n;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: readerCompact()
+ * ** Description: Moves the unparsed bytes to the front of the
+ *      reader, so a request's messages always have room to arrive.
+ * ** Parameters: The connection's reader.
+ * ** Pre-Conditions: No message handed out earlier is still in use.
+ * ** Post-Conditions: head is 0.
+ * *********************************************************************/
+void readerCompact(struct cmdReader *r){
+    if(r->head == 0) return;
+    memmove(r->buf, r->buf + r->head, r->tail - r->head);
+    r->tail -= r->head;
+    r->scan -= r->head;
+    r->head = 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: moreCommands()
+ * ** Description: Decides whether to serve another request on this
+ *      control connection. In event-driven mode the session simply
+ *      waits for one, since an idle coroutine costs nothing. The
+ *      blocking loop only continues if a command is already buffered
+ *      or readable, so one idle client can't hold up the others.
+ * ** Parameters: The connection's reader, the control connection's
+ *      file descriptor.
+ * ** Pre-Conditions: The previous request is finished.
+ * ** Post-Conditions: Returns 1 to read another command, else 0.
+ * *********************************************************************/
+int moreCommands(struct cmdReader *r, int socketFD){
+    struct pollfd pfd = { socketFD, POLLIN, 0 };
+
+    if(eventMode || stopping) return !stopping;
+    if(r->scan == r->head && scanDelims(r->buf + r->head, r->tail - r->head, 0) < 0)
+        r->head = r->scan = r->tail;
+    return r->head < r->tail || poll(&pfd, 1, 0) > 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: takeCancel()
+ * ** Description: Looks through the whole messages buffered in a
+ *      reader for a "-cancel" and removes it, by blanking it into
+ *      padding, so commands pipelined around it still parse.
+ * ** Parameters: The connection's reader.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 1 if a cancel was found, else 0.
+ * *********************************************************************/
+int takeCancel(struct cmdReader *r){
+    int at = r->head, start, n;
+
+    while(at < r->tail){
+        if((n = scanDelims(r->buf + at, r->tail - at, 0)) < 0)
+            break;
+        start = at + n;
+        if((n = scanDelims(r->buf + start, r->tail - start, 1)) < 0)
+            break;
+        if(n == 7 && memcmp(r->buf + start, "-cancel", 7) == 0){
+            memset(r->buf + start, '\0', n);
+            r->scan = r->head;
+            return 1;
+        }
+        at = start + n + 1;
+    }
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: readerSqueeze()
+ * ** Description: Makes room in a full reader while a request still
+ *      uses the messages at its front, by collapsing the padding
+ *      between the messages not yet parsed to one delimiter each.
+ *      ftclient.py's 500 byte frames are mostly padding, so a
+ *      pipeline of them no longer fills the reader before a
+ *      "-cancel" behind it can be read.
+ * ** Parameters: The connection's reader.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Every message is kept, and head and scan are
+ *      unchanged.
+ * *********************************************************************/
+void readerSqueeze(struct cmdReader *r){
+    int from = r->scan, to = r->scan;
+
+    while(from < r->tail){
+        char c = r->buf[from++];
+        if((c == '\0' || c == '\n') && to > r->scan
+                && (r->buf[to - 1] == '\0' || r->buf[to - 1] == '\n'))
+            continue;
+        r->buf[to++] = c;
+    }
+    r->tail = to;
+}
+
+
+
+/*********************************************************************
+ * ** Function: cancelRequested()
+ * ** Description: Reads whatever the client has sent on the watched
+ *      control connection, without waiting, and checks it for a
+ *      "-cancel". A control connection the client has closed isn't
+ *      watched any more.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 1, with watch.cancelled set, if the
+ *      request being served has been cancelled, else 0.
+ * *********************************************************************/
+int cancelRequested(){
+    struct cmdReader *r = watch.reader;
+    ssize_t n;
+
+    if(watch.cancelled || watch.controlFD < 0)
+        return watch.cancelled;
+    if(r->tail == READER_SIZE) readerSqueeze(r);
+    while(r->tail < READER_SIZE){
+        n = recv(watch.controlFD, r->buf + r->tail, READER_SIZE - r->tail, MSG_DONTWAIT);
+        if(n < 0 && errno == EINTR) continue;
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            watch.controlFD = -1;
+        if(n <= 0) break;
+        r->tail += n;
+    }
+    return watch.cancelled = takeCancel(r);
+}
+
+
+
+/*********************************************************************
+ * ** Function: waitWritable()
+ * ** Description: Waits for the watched data connection to take more
+ *      data, or for the client to say something on its control
+ *      connection, whichever comes first. A blocking process polls
+ *      both; a coroutine waits on both in epoll and leaves neither
+ *      armed afterwards. The wait ends at the request's deadline:
+ *      poll()'s timeout in a blocking process, timedExpire() waking
+ *      the coroutine (see coWait()) in event-driven mode.
+ * ** Parameters: The data connection's file descriptor.
+ * ** Pre-Conditions: fd is watch.dataFD and a write to it would block.
+ * ** Post-Conditions: Returns 0 to retry the write, or -1 with errno
+ *      ECANCELED or ETIMEDOUT if the request should stop.
+ * *********************************************************************/
+int waitWritable(int fd){
+    struct pollfd pfd[2] = { { fd, POLLOUT, 0 }, { watch.controlFD, POLLIN, 0 } };
+    int watching, timeout = -1;
+
+    if(watch.controlFD >= 0 && watch.reader->tail == READER_SIZE) readerSqueeze(watch.reader);
+    watching = watch.controlFD >= 0 && watch.reader->tail < READER_SIZE;
+
+    if(deadlinePassed())
+        return -1;
+    if(requestDeadline > 0)
+        timeout = requestDeadline > nowUsec() ? (requestDeadline - nowUsec() + 999) / 1000 : 0;
+    if(currentCo == NULL){
+        while(poll(pfd, watching ? 2 : 1, timeout) < 0 && errno == EINTR);
+    }
+    else if(!watching)
+        coWait(fd, EPOLLOUT);
+    else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = currentCo;
+        if(epoll_ctl(epollFD, EPOLL_CTL_MOD, watch.controlFD, &ev) < 0)
+            epoll_ctl(epollFD, EPOLL_CTL_ADD, watch.controlFD, &ev);
+        coWait(fd, EPOLLOUT);
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, watch.controlFD, NULL);
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL);
+    }
+    if(cancelRequested()){
+        errno = ECANCELED;
+        return -1;
+    }
+    return deadlinePassed() ? -1 : 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: ioWrite()
+ * ** Description: Writes all of buf, waiting in a coroutine whenever
+ *      the socket buffer is full, and carrying on after short writes.
+ *      Bulk coroutines also yield after every BULK_SLICE bytes. Fails
+ *      with ETIMEDOUT once the request's deadline has passed. On the
+ *      watched data connection it never blocks without also watching
+ *      for "-cancel", and checks for one every CANCEL_CHECK bytes;
+ *      once the request is cancelled writes fail with ECANCELED.
+ * ** Parameters: As write().
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns len, or -1 on the first error.
+ * *********************************************************************/
+ssize_t ioWrite(int fd, const void *buf, size_t len){
+    size_t done = 0;
+
+    if(deadlinePassed())
+        return -1;
+    if(watch.cancelled){
+        errno = ECANCELED;
+        return -1;
+    }
+    while(done < len){
+        ssize_t n;
+        if(fd == watch.dataFD){
+            n = send(fd, (const char *) buf + done, len - done, MSG_DONTWAIT);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                if(waitWritable(fd) < 0) return -1;
+                continue;
+            }
+            if(n > 0 && (watch.unchecked += n) >= CANCEL_CHECK){
+                watch.unchecked = 0;
+                if(cancelRequested()){
+                    errno = ECANCELED;
+                    return -1;
+                }
+            }
+        }
+        else
+            n = write(fd, (const char *) buf + done, len - done);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && currentCo != NULL){
+            if(deadlinePassed()) return -1;
+            coWait(fd, EPOLLOUT);
+            continue;
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        done += n;
+
+        //A bulk session gives way now and then even if the socket
+        //never fills up
+        if(currentCo != NULL && currentCo->cls == CLASS_BULK && (currentCo->unyielded += n) >= BULK_SLICE){
+            currentCo->unyielded = 0;
+            coYield();
+        }
+    }
+    return len;
+}
+
+
+
+/*********************************************************************
+ * ** Function: ioConnect()
+ * ** Description: connect() that waits in a coroutine for a
+ *      non-blocking connect to complete.
+ * ** Parameters: As connect().
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0, or -1 with errno set.
+ * *********************************************************************/
+int ioConnect(int fd, const struct sockaddr *addr, socklen_t len){
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+
+    if(connect(fd, addr, len) == 0) return 0;
+    if(errno != EINPROGRESS || currentCo == NULL) return -1;
+    coWait(fd, EPOLLOUT);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0) return -1;
+    if(err != 0){
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: ioAccept()
+ * ** Description: Accepts one connection on a listener, waiting up to
+ *      the given number of seconds for it. A coroutine waits in the
+ *      event loop, on a non-blocking listener, and the connection it
+ *      gets is non-blocking too; a blocking process polls.
+ * ** Parameters: The listening socket's file descriptor, the most
+ *      seconds to wait.
+ * ** Pre-Conditions: In a coroutine, the listener is non-blocking.
+ * ** Post-Conditions: Returns the connection's file descriptor, or -1
+ *      (errno ETIMEDOUT if nobody connected in time).
+ * *********************************************************************/
+int ioAccept(int listenFD, int seconds){
+    long long until = nowUsec() + seconds * 1000000LL;
+    struct pollfd pfd = { listenFD, POLLIN, 0 };
+    int fd;
+
+    if(currentCo == NULL){
+        if(poll(&pfd, 1, seconds * 1000) == 1)
+            return accept(listenFD, NULL, NULL);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    while(1){
+        fd = accept4(listenFD, NULL, NULL, SOCK_NONBLOCK);
+        if(fd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return fd;
+        if(deadlinePassed()) return -1;
+        if(nowUsec() >= until){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        coWaitUntil(listenFD, EPOLLIN, until);
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendMsg()
+ * ** Description: Sends messages to the client over the specified
+ *      socket. A failed write (usually a client that went away) is
+ *      reported but does not stop the server.
+ *      The padded frame is built on the stack, so the command being
+ *      handled is never overwritten by a reply.
+ * ** Parameters: A socket file descriptor (for the socket
+ *      over which the message will be sent), a pointer to a
+ *      const char message to be sent.
+ * ** Pre-Conditions: The connection file descriptor must be associated
+ *      with an open socket. The message must be shorter than
+ *      BUFFER_SIZE.
+ * ** Post-Conditions: The message will be sent to a connected client.
+ *      Returns 0, or -1 if the write failed.
+ * *********************************************************************/
+int sendMsg(int socketFD, const char *msg){
+    char frame[BUFFER_SIZE];
+
+    //Write to the socket
+    bzero(frame, BUFFER_SIZE);
+    strncpy(frame, msg, BUFFER_SIZE - 1);
+    int success = ioWrite(socketFD, frame, BUFFER_SIZE);
+    if(success < 0){
+        perror("ERROR writing message to socket");
+        return -1;
+    }
+    return 0;
 }
 
 
@@ -153,16 +1125,19 @@ void recMsg(char *buffer, int socketFD){
  *      connection, the server socket's file descriptor.
  * ** Pre-Conditions: The server must be open and listening.
  * ** Post-Conditions: The server will accept client connections.
+ *      Returns the control connection's file descriptor, or -1 if
+ *      accept() failed (e.g. out of file descriptors).
  **********************************************************************/
-void acceptClient(struct sockaddr_in *cliAddr, int *controlFD, int servFD){
+int acceptClient(struct sockaddr_in *cliAddr, int *controlFD, int servFD){
     socklen_t clilen = sizeof(*cliAddr);
 
     //Start accepting client connections
     *controlFD = accept(servFD,(struct sockaddr*) cliAddr, &clilen);
 
     //Check for success
-    if(*controlFD < 0) error("ERROR on accept");
-    else printf("Connection from client.\n");
+    if(*controlFD >= 0) printf("Connection from client.\n");
+    else if(errno != EINTR) perror("ERROR on accept");
+    return *controlFD;
 }
 
 
@@ -186,7 +1161,6 @@ void sendDir(int socketFD, int portNum){
     //Create DIR stream pointer and dirent struct pointer
     DIR *d;
     struct dirent *dir;
-    char *buffer = malloc(BUFFER_SIZE);
 
     //Open the directory
     d = opendir(".");
@@ -197,16 +1171,15 @@ void sendDir(int socketFD, int portNum){
         //While there are items in the directory
         while((dir = readdir(d)) != NULL){
             //Send that item's name across to the client
-            sendMsg(socketFD, buffer, strcat(dir->d_name, "\n"));
+            sendMsg(socketFD, strcat(dir->d_name, "\n"));
         }
 
         //Signal to client that sending is finished
-        sendMsg(socketFD, buffer, "~done\n");
+        sendMsg(socketFD, "~done\n");
     }
 
     //Close the directory
     closedir(d);
-    free(buffer);
 }
 
 
@@ -250,38 +1223,2240 @@ int inDir(char* fileName){
 
 
 /*********************************************************************
- * ** Function: sendFile()
- * ** Description: Gets the file specified by the client and sends
- *      the file across in pieces until finished.
- * ** Parameters: A pointer to the file name, the socket file
- *      descriptor.
- * ** Pre-Conditions: There must be an open between client
- *      and server, the file name must be specified, the file
- *      must exist in the directory.
- * ** Post-Conditions: The file transfer will occur, otherwise
- *      the program will terminate with an error message.
+ * ** Function: transferLate()
+ * ** Description: Decides whether a transfer with a deadline can still
+ *      make it at the rate it has managed so far, so a hopeless one
+ *      stops early instead of using bandwidth up to the deadline. The
+ *      rate is only trusted after LATE_SAMPLE_USEC.
+ * ** Parameters: Bytes sent so far, bytes in the whole transfer, when
+ *      it started (nowUsec() time).
+ * ** Pre-Conditions: requestDeadline is set.
+ * ** Post-Conditions: Returns 1, and marks the request as cut off, if
+ *      the rest can't arrive in time; 0 otherwise.
  * *********************************************************************/
-void sendFile(char *fileName, int socketFD, int portNum){
-    //Create buffer for file transfer
-    char *buffer = malloc(BUFFER_SIZE);
+int transferLate(long long done, long long total, long long startUsec){
+    long long now = nowUsec(), elapsed = now - startUsec;
+
+    if(requestDeadline < 0)
+        return 1;
+    if(elapsed < LATE_SAMPLE_USEC || done <= 0 || done >= total)
+        return 0;
+    if(now + (double) (total - done) * elapsed / done <= requestDeadline)
+        return 0;
+    requestDeadline = -1;
+    return 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendFile()
+ * ** Description: Gets the file specified by the client and sends
+ *      the file across in pieces until finished.
+ * ** Parameters: A pointer to the file name, the byte offset to start
+ *      from (0 for the whole file), the socket file descriptor.
+ * ** Pre-Conditions: There must be an open between client
+ *      and server, the file name must be specified, the file
+ *      must exist in the directory.
+ * ** Post-Conditions: The file transfer will occur. Returns 0, or -1
+ *      (after reporting the error) if the file can't be read, the
+ *      client stops accepting data or the request's deadline can't
+ *      be met.
+ * *********************************************************************/
+int sendFile(char *fileName, long long offset, int socketFD, int portNum){
     //Create file pointer and open file to read
     FILE *file = fopen(fileName, "r");
-    if(file == NULL) error("Can't open file.\n");
+    if(file == NULL){
+        perror("Can't open file");
+        return -1;
+    }
+    //Create buffer for file transfer
+    char *buffer = malloc(BUFFER_SIZE);
+    int result = 0;
+    long long sent = 0, total = 0, start = nowUsec();
+    struct stat st;
     printf("Sending \"%s\" requested on port %i.\n", fileName, portNum);
+    if(offset > 0) fseek(file, offset, SEEK_SET);
+    if(requestDeadline != 0 && fstat(fileno(file), &st) == 0)
+        total = st.st_size - offset;
+
+    //While there are characters in the file
+    while(!feof(file)){
+        //Read from the file
+        int numBytesRead = fread(buffer, sizeof(char), 500, file);
+        //Send data chunks to client
+        int success = ioWrite(socketFD, buffer, numBytesRead);
+        if(success < 0){
+            perror("ERROR writing file to socket");
+            result = -1;
+            break;
+        }
+        __atomic_add_fetch(&metrics->bytesSent, success, __ATOMIC_RELAXED);
+        bytesSentHere += success;
+        sent += success;
+        if(requestDeadline != 0 && transferLate(sent, total, start)){
+            printf("Stopping \"%s\", it can't meet its deadline.\n", fileName);
+            result = -1;
+            break;
+        }
+    }
+    //Close file
+    fclose(file);
+    //Free buffer
+    free(buffer);
+    return result;
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendFileIntent()
+ * ** Description: Tells the client a file follows, as "fil size",
+ *      so it can preallocate the destination. The size is taken now;
+ *      if the file changes before it's sent the client gets what
+ *      sendFile() actually reads.
+ * ** Parameters: The socket file descriptor, the file name, the
+ *      offset the transfer starts from.
+ * ** Pre-Conditions: The file should exist.
+ * ** Post-Conditions: The message is sent. Returns sendMsg()'s result.
+ * *********************************************************************/
+int sendFileIntent(int socketFD, const char *fileName, long long offset){
+    struct stat st;
+    char msg[64];
+    long long size = stat(fileName, &st) == 0 ? st.st_size - offset : 0;
+
+    snprintf(msg, sizeof(msg), "fil %lld\n", size > 0 ? size : 0);
+    return sendMsg(socketFD, msg);
+}
+
+
+
+/*********************************************************************
+ * ** Function: splitArgs()
+ * ** Description: Splits a command buffer into whitespace separated
+ *      words, in place.
+ * ** Parameters: Pointer to the command string, an array to receive
+ *      pointers to each word, the size of that array.
+ * ** Pre-Conditions: The command string must be null-terminated.
+ * ** Post-Conditions: Returns the number of words found. The command
+ *      string is modified (separators are replaced by '\0').
+ * *********************************************************************/
+int splitArgs(char *cmd, char **args, int maxArgs){
+    int n = 0;
+    char *save = NULL;
+    char *word = strtok_r(cmd, " \t\r\n", &save);
+    while(word != NULL && n < maxArgs){
+        args[n++] = word;
+        word = strtok_r(NULL, " \t\r\n", &save);
+    }
+    return n;
+}
+
+
+
+/*********************************************************************
+ * ** Function: validName()
+ * ** Description: Checks that a file name refers to an entry directly
+ *      inside the served directory, so server-side commands can't
+ *      touch anything outside of it.
+ * ** Parameters: Pointer to the file name.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns true if the name is usable.
+ * *********************************************************************/
+int validName(const char *name){
+    if(name == NULL || name[0] == '\0') return 0;
+    if(strchr(name, '/') != NULL) return 0;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    return 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: parseSize()
+ * ** Description: Parses a byte count with an optional K, M or G
+ *      suffix.
+ * ** Parameters: The string to parse.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the number of bytes.
+ * *********************************************************************/
+long long parseSize(const char *str){
+    char *end;
+    long long n = strtoll(str, &end, 10);
+    switch(*end){
+        case 'g': case 'G': n <<= 10; //fall through
+        case 'm': case 'M': n <<= 10; //fall through
+        case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
+
+
+
+/*********************************************************************
+ * ** Function: copyFile()
+ * ** Description: Copies (or appends) one file to another without the
+ *      data leaving the kernel, using copy_file_range(). Filesystems
+ *      that support reflinks can complete this without copying any
+ *      blocks. Falls back to a read/write loop where copy_file_range()
+ *      isn't supported.
+ * ** Parameters: Source file name, destination file name, and a flag
+ *      that appends to the destination instead of truncating it.
+ * ** Pre-Conditions: Both names must have passed validName().
+ * ** Post-Conditions: Returns the number of bytes copied, or -1 with
+ *      errno set.
+ * *********************************************************************/
+long long copyFile(const char *src, const char *dst, int append){
+    struct stat st;
+    long long copied = 0;
+    int inFD = open(src, O_RDONLY);
+    if(inFD < 0) return -1;
+    if(fstat(inFD, &st) < 0){
+        close(inFD);
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode)){
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        close(inFD);
+        return -1;
+    }
+
+    //copy_file_range() refuses O_APPEND descriptors, so appends
+    //write at an explicit offset instead
+    int outFD = open(dst, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    if(outFD < 0){
+        close(inFD);
+        return -1;
+    }
+    loff_t outOff = append ? lseek(outFD, 0, SEEK_END) : 0;
+
+    //Let the kernel move the data
+    while(copied < st.st_size){
+        ssize_t n = copy_file_range(inFD, NULL, outFD, &outOff, st.st_size - copied, 0);
+        if(n <= 0) break;
+        copied += n;
+    }
+
+    //Fall back to copying through a buffer if the kernel couldn't
+    if(copied < st.st_size){
+        char *buffer = malloc(BUFFER_SIZE);
+        ssize_t n;
+        lseek(inFD, copied, SEEK_SET);
+        while((n = read(inFD, buffer, BUFFER_SIZE)) > 0){
+            if(pwrite(outFD, buffer, n, outOff) != n){
+                n = -1;
+                break;
+            }
+            outOff += n;
+            copied += n;
+        }
+        free(buffer);
+        if(n < 0) copied = -1;
+    }
+
+    close(inFD);
+    if(close(outFD) < 0) copied = -1;
+    return copied;
+}
+
+
+
+/*********************************************************************
+ * ** Function: handleFileOp()
+ * ** Description: Runs a server-side copy, move or concatenate so
+ *      files can be reorganized without passing through the client.
+ *          -cp src dst           copy src to dst
+ *          -mv src dst           rename src to dst
+ *          -cat dst src [...]    append each src to dst, in order
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must begin with one of the words
+ *      above.
+ * ** Post-Conditions: Sends "ok" on success, "nof" if a source file
+ *      doesn't exist, or "err" if the command was malformed or failed.
+ * *********************************************************************/
+void handleFileOp(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+    const char *reply = "ok\n";
+    long long total = 0;
+    int i;
+
+    //Validate every name before touching anything
+    int valid = argc >= 3;
+    for(i = 1; i < argc && valid; i++)
+        valid = validName(args[i]);
+    if(valid && strcmp(args[0], "-cat") != 0)
+        valid = argc == 3 && strcmp(args[1], args[2]) != 0;
+    for(i = 2; i < argc && valid && strcmp(args[0], "-cat") == 0; i++)
+        valid = strcmp(args[1], args[i]) != 0;
+
+    if(!valid){
+        printf("Malformed \"%s\" requested on port %i.\n", args[0], portNum);
+        reply = "err\n";
+    }
+    else if(strcmp(args[0], "-cat") == 0){
+        printf("Concatenating into \"%s\" requested on port %i.\n", args[1], portNum);
+        for(i = 2; i < argc && reply[0] == 'o'; i++)
+            if(inDir(args[i]) == 0) reply = "nof\n";
+        //Start from an empty destination, then append each source
+        for(i = 2; i < argc && reply[0] == 'o'; i++){
+            long long n = copyFile(args[i], args[1], i > 2);
+            if(n < 0) reply = "err\n";
+            else total += n;
+        }
+    }
+    else if(inDir(args[1]) == 0){
+        printf("File not found. Sending error message to client: %i.\n", portNum);
+        reply = "nof\n";
+    }
+    else if(strcmp(args[0], "-cp") == 0){
+        printf("Copying \"%s\" to \"%s\" requested on port %i.\n", args[1], args[2], portNum);
+        total = copyFile(args[1], args[2], 0);
+        if(total < 0) reply = "err\n";
+    }
+    else {
+        printf("Moving \"%s\" to \"%s\" requested on port %i.\n", args[1], args[2], portNum);
+        if(rename(args[1], args[2]) < 0) reply = "err\n";
+    }
+
+    if(reply[0] == 'e' && valid) perror("Server-side file operation failed");
+    else if(reply[0] == 'o') printf("Done, %lld bytes copied.\n", total);
+    sendMsg(socketFD, reply);
+    free(cmd);
+}
+
+
+
+/*********************************************************************
+ * ** Function: readFull()
+ * ** Description: Reads exactly len bytes from a socket, looping over
+ *      short reads. In a coroutine each read waits at most
+ *      PUSH_TIMEOUT seconds, as SO_RCVTIMEO limits peer sockets in a
+ *      blocking process.
+ * ** Parameters: The socket file descriptor, the buffer to fill, the
+ *      number of bytes wanted.
+ * ** Pre-Conditions: The buffer must hold at least len bytes.
+ * ** Post-Conditions: Returns len, or fewer if the peer closed the
+ *      connection first, or -1 on error.
+ * *********************************************************************/
+int readFull(int socketFD, char *buffer, int len){
+    int got = 0;
+    while(got < len){
+        int n = ioReadWithin(socketFD, buffer + got, len - got, PUSH_TIMEOUT);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        if(n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+
+
+/*********************************************************************
+ * ** Function: openEphemeral()
+ * ** Description: Opens a listening socket on any free port, for
+ *      connections the server asks a peer to make back to it. It's
+ *      non-blocking in a coroutine, for ioAccept().
+ * ** Parameters: The address of an int to receive the port number.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the listening socket's file descriptor,
+ *      or -1 with errno set.
+ * *********************************************************************/
+int openEphemeral(int *port){
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int listenFD;
+
+    createSocket(&listenFD);
+    if(currentCo != NULL) fcntl(listenFD, F_SETFL, O_NONBLOCK);
+    bzero((char *) &addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    if(bind(listenFD, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listenFD, 1) < 0
+            || getsockname(listenFD, (struct sockaddr *) &addr, &addrLen) < 0){
+        int saved = errno;
+        close(listenFD);
+        errno = saved;
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return listenFD;
+}
+
+
+
+/*********************************************************************
+ * ** Function: makeToken()
+ * ** Description: Fills a buffer with a random hex token from
+ *      /dev/urandom, used to authorize a single server-to-server push.
+ * ** Parameters: A buffer of at least TOKEN_LEN + 1 characters.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0 and a null-terminated token, or -1 if
+ *      no randomness was available.
+ * *********************************************************************/
+int makeToken(char *token){
+    unsigned char raw[TOKEN_LEN / 2];
+    int i;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd < 0) return -1;
+    int n = readFull(fd, (char *) raw, sizeof(raw));
+    close(fd);
+    if(n != (int) sizeof(raw)) return -1;
+    for(i = 0; i < (int) sizeof(raw); i++)
+        sprintf(token + 2 * i, "%02x", raw[i]);
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: tokensMatch()
+ * ** Description: Compares two tokens in constant time so a pusher
+ *      can't learn the token one character at a time.
+ * ** Parameters: The expected token, the token presented.
+ * ** Pre-Conditions: The expected token must be TOKEN_LEN characters.
+ * ** Post-Conditions: Returns true if the tokens are identical.
+ * *********************************************************************/
+int tokensMatch(const char *expected, const char *given){
+    int diff = strlen(given) != TOKEN_LEN;
+    int i;
+    for(i = 0; i < TOKEN_LEN && given[i] != '\0'; i++)
+        diff |= expected[i] ^ given[i];
+    return diff == 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: recvPush()
+ * ** Description: Receiving half of a server-to-server transfer
+ *      ("-rcv name"). Opens a one-shot listener on an ephemeral port,
+ *      tells the client its port and a one-time token, then accepts a
+ *      single connection from the pushing server. The pusher must send
+ *      the token as its first message and the file's size as its
+ *      second; the file follows until EOF, and anything shorter or
+ *      longer than the announced size is rejected.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-rcv ".
+ * ** Post-Conditions: Sends "tok <port> <token>" and, once the push
+ *      is done, "ok <bytes>". Sends "err" if anything fails; the
+ *      destination is only replaced by a complete transfer.
+ * *********************************************************************/
+void recvPush(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+    char token[TOKEN_LEN + 1];
+    char tmpName[BUFFER_SIZE];
+    char msg[BUFFER_SIZE];
+    long long total = 0, size = -1;
+    int listenFD = -1, peerFD = -1, outFD = -1;
+    int ok = 0;
+
+    if(argc != 2 || !validName(args[1]) || (int) strlen(args[1]) > BUFFER_SIZE - 16
+            || makeToken(token) < 0){
+        sendMsg(socketFD, "err\n");
+        free(cmd);
+        return;
+    }
+
+    //Listen on any free port for the pushing server
+    int pushPort;
+    listenFD = openEphemeral(&pushPort);
+    if(listenFD < 0){
+        perror("ERROR opening push listener");
+        sendMsg(socketFD, "err\n");
+        free(cmd);
+        return;
+    }
+    printf("Awaiting push of \"%s\" on port %i, requested on port %i.\n",
+            args[1], pushPort, portNum);
+    snprintf(msg, sizeof(msg), "tok %i %s\n", pushPort, token);
+    sendMsg(socketFD, msg);
+
+    //Only one connection is ever accepted, so the token is single use
+    peerFD = ioAccept(listenFD, PUSH_TIMEOUT);
+    close(listenFD);
+
+    if(peerFD >= 0){
+        struct timeval tv = { PUSH_TIMEOUT, 0 };
+        setsockopt(peerFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if(readFull(peerFD, msg, BUFFER_SIZE) == BUFFER_SIZE){
+            msg[BUFFER_SIZE - 1] = '\0';
+            msg[strcspn(msg, "\n")] = '\0';
+            ok = tokensMatch(token, msg);
+        }
+        if(!ok) printf("Push rejected: bad token.\n");
+        else if(readFull(peerFD, msg, BUFFER_SIZE) == BUFFER_SIZE){
+            msg[BUFFER_SIZE - 1] = '\0';
+            size = atoll(msg);
+        }
+        if(ok && size < 0){
+            printf("Push rejected: no size.\n");
+            ok = 0;
+        }
+    }
+    else printf("Push of \"%s\" never arrived.\n", args[1]);
+
+    //Receive into a temporary name, then move it into place
+    if(ok){
+        snprintf(tmpName, sizeof(tmpName), ".%s.rcv", args[1]);
+        outFD = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = outFD >= 0;
+    }
+    char *data = malloc(RECV_CHUNK);
+    while(ok){
+        int n = ioReadWithin(peerFD, data, RECV_CHUNK, PUSH_TIMEOUT);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            //A pusher that fails part way closes early, so only the
+            //announced size counts as complete
+            ok = n == 0 && total == size;
+            if(n == 0 && !ok) printf("Push of \"%s\" ended at %lld of %lld bytes.\n", args[1], total, size);
+            break;
+        }
+        if(write(outFD, data, n) != n || (total += n) > size) ok = 0;
+    }
+    free(data);
+    if(outFD >= 0){
+        if(close(outFD) < 0) ok = 0;
+        if(ok && rename(tmpName, args[1]) < 0) ok = 0;
+        if(!ok) unlink(tmpName);
+    }
+    if(peerFD >= 0) close(peerFD);
+
+    if(ok){
+        printf("Received %lld bytes into \"%s\".\n", total, args[1]);
+        snprintf(msg, sizeof(msg), "ok %lld\n", total);
+        sendMsg(socketFD, msg);
+    }
+    else sendMsg(socketFD, "err\n");
+    free(cmd);
+}
+
+
+
+/*********************************************************************
+ * ** Function: pushFile()
+ * ** Description: Sending half of a server-to-server transfer
+ *      ("-push name host port token"). Connects to the receiving
+ *      server's one-shot listener, presents the token and the file's
+ *      size and streams the file with sendfile(), reporting progress to the client while
+ *      it goes so the data never passes through the client.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-push ". The
+ *      receiving server must already be waiting (see recvPush()).
+ * ** Post-Conditions: Sends "psh <size>", then "prg <sent> <size>"
+ *      about once a second, then "ok <bytes> <usec>" on success.
+ *      Sends "nof" or "err" on failure.
+ * *********************************************************************/
+void pushFile(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+    char msg[BUFFER_SIZE];
+    struct addrinfo hints, *peer = NULL;
+    struct stat st;
+    int fileFD = -1, peerFD = -1;
+
+    if(argc != 5 || !validName(args[1])){
+        sendMsg(socketFD, "err\n");
+        free(cmd);
+        return;
+    }
+    if(inDir(args[1]) == 0 || (fileFD = open(args[1], O_RDONLY)) < 0){
+        printf("File not found. Sending error message to client: %i.\n", portNum);
+        sendMsg(socketFD, "nof\n");
+        free(cmd);
+        return;
+    }
+    fstat(fileFD, &st);
+
+    //Connect to the receiving server and present the token
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(args[2], args[3], &hints, &peer) == 0){
+        createSocket(&peerFD);
+        if(currentCo != NULL) fcntl(peerFD, F_SETFL, O_NONBLOCK);
+        if(ioConnect(peerFD, peer->ai_addr, peer->ai_addrlen) < 0){
+            close(peerFD);
+            peerFD = -1;
+        }
+        freeaddrinfo(peer);
+    }
+    if(peerFD < 0){
+        perror("ERROR connecting to receiving server");
+        sendMsg(socketFD, "err\n");
+        close(fileFD);
+        free(cmd);
+        return;
+    }
+    printf("Pushing \"%s\" to %s:%s, requested on port %i.\n", args[1], args[2], args[3], portNum);
+    sendMsg(peerFD, args[4]);
+    snprintf(msg, sizeof(msg), "%lld", (long long) st.st_size);
+    sendMsg(peerFD, msg);
+    snprintf(msg, sizeof(msg), "psh %lld\n", (long long) st.st_size);
+    sendMsg(socketFD, msg);
+
+    //Stream the file, reporting progress about once a second
+    long long start = nowUsec(), lastReport = start;
+    off_t sent = 0;
+    int ok = 1;
+    while(sent < st.st_size){
+        ssize_t n = sendfile(peerFD, fileFD, &sent, PUSH_CHUNK);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && currentCo != NULL){
+            if(deadlinePassed()){
+                ok = 0;
+                break;
+            }
+            coWait(peerFD, EPOLLOUT);
+            continue;
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            ok = 0;
+            break;
+        }
+        if(nowUsec() - lastReport >= 1000000){
+            lastReport = nowUsec();
+            snprintf(msg, sizeof(msg), "prg %lld %lld\n", (long long) sent, (long long) st.st_size);
+            sendMsg(socketFD, msg);
+        }
+    }
+    close(fileFD);
+    close(peerFD);
+
+    long long elapsed = nowUsec() - start;
+    if(ok){
+        printf("Pushed %lld bytes in %lld usec.\n", (long long) sent, elapsed);
+        snprintf(msg, sizeof(msg), "ok %lld %lld\n", (long long) sent, elapsed);
+        sendMsg(socketFD, msg);
+    }
+    else {
+        perror("ERROR pushing file");
+        sendMsg(socketFD, "err\n");
+    }
+    free(cmd);
+}
+
+
+
+/*********************************************************************
+ * ** Function: hashBytes()
+ * ** Description: Folds a block of bytes into a 64-bit FNV-1a hash,
+ *      used to check that a file's contents match between servers.
+ * ** Parameters: The hash so far, the bytes, the number of bytes.
+ * ** Pre-Conditions: Start a new hash with FNV_OFFSET.
+ * ** Post-Conditions: Returns the updated hash.
+ * *********************************************************************/
+#define FNV_OFFSET 14695981039346656037ULL
+unsigned long long hashBytes(unsigned long long h, const char *bytes, long len){
+    long i;
+    for(i = 0; i < len; i++){
+        h ^= (unsigned char) bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+
+/*********************************************************************
+ * ** Function: fileHash()
+ * ** Description: Returns the FNV-1a hash of a file's contents, or of
+ *      just its first len bytes. Whole-file results are remembered
+ *      per root, name, size and mtime so an unchanged file is only
+ *      read once.
+ * ** Parameters: The file name, the file's stat results, the number
+ *      of leading bytes to hash (-1 for the whole file).
+ * ** Pre-Conditions: The file must exist and be readable.
+ * ** Post-Conditions: Returns the hash (the hash of nothing if the
+ *      file can't be read).
+ * *********************************************************************/
+unsigned long long fileHash(const char *name, struct stat *st, long long len){
+    long long mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    struct hashMemo *memo = &cwdRoot->hashMemos[hashBytes(FNV_OFFSET, name, strlen(name)) % HASH_MEMOS];
+    unsigned long long h = FNV_OFFSET;
+    int whole = len < 0 || len >= st->st_size;
+
+    if(whole && strcmp(memo->name, name) == 0 && memo->size == st->st_size && memo->mtime == mtime)
+        return memo->hash;
+
+    int fd = open(name, O_RDONLY);
+    if(fd >= 0){
+        char *data = malloc(RECV_CHUNK);
+        long long left = whole ? st->st_size : len;
+        int n;
+        while(left > 0 && (n = read(fd, data, left < RECV_CHUNK ? left : RECV_CHUNK)) > 0){
+            h = hashBytes(h, data, n);
+            left -= n;
+        }
+        free(data);
+        close(fd);
+    }
+    if(whole && strlen(name) < sizeof(memo->name)){
+        strcpy(memo->name, name);
+        memo->size = st->st_size;
+        memo->mtime = mtime;
+        memo->hash = h;
+    }
+    return h;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexSlot()
+ * ** Description: Finds where a name's entry is, or would be linked,
+ *      in the index's hash chains.
+ * ** Parameters: The index, the file name.
+ * ** Pre-Conditions: The index must have buckets.
+ * ** Post-Conditions: Returns the link pointing at the entry, which
+ *      points at NULL if the name isn't indexed.
+ * *********************************************************************/
+struct dirEntry **indexSlot(struct dirIndex *ix, const char *name){
+    struct dirEntry **slot = &ix->buckets[hashBytes(FNV_OFFSET, name, strlen(name)) % ix->numBuckets];
+    while(*slot != NULL && strcmp((*slot)->name, name) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexGrow()
+ * ** Description: Doubles the index's bucket count and rehashes the
+ *      entries into the new chains.
+ * ** Parameters: The index.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The index has twice the buckets (at least 64),
+ *      or is unchanged if memory ran out.
+ * *********************************************************************/
+void indexGrow(struct dirIndex *ix){
+    long numBuckets = ix->numBuckets ? ix->numBuckets * 2 : 64, i;
+    struct dirEntry **buckets = calloc(numBuckets, sizeof(*buckets));
+    struct dirEntry *e, *next;
+
+    if(buckets == NULL) return;
+    for(i = 0; i < ix->numBuckets; i++){
+        for(e = ix->buckets[i]; e != NULL; e = next){
+            long b = hashBytes(FNV_OFFSET, e->name, strlen(e->name)) % numBuckets;
+            next = e->next;
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(ix->buckets);
+    ix->buckets = buckets;
+    ix->numBuckets = numBuckets;
+}
+
+
+
+/*********************************************************************
+ * ** Function: rankBefore()
+ * ** Description: The order of a rank list: larger (or newer) first,
+ *      ties by name.
+ * ** Parameters: Two entries, which rank list.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns true if a sorts before b.
+ * *********************************************************************/
+int rankBefore(struct dirEntry *a, struct dirEntry *b, int which){
+    long long ka = which == RANK_SIZE ? a->size : a->mtime;
+    long long kb = which == RANK_SIZE ? b->size : b->mtime;
+    return ka > kb || (ka == kb && strcmp(a->name, b->name) < 0);
+}
+
+
+
+/*********************************************************************
+ * ** Function: rankSeek()
+ * ** Description: Finds, on every level of a rank list, the last node
+ *      that sorts before an entry.
+ * ** Parameters: The index, which rank list, the entry, an array of
+ *      RANK_LEVELS nodes to fill in.
+ * ** Pre-Conditions: The list's head must exist.
+ * ** Post-Conditions: update[l] is the last node before e on level l.
+ * *********************************************************************/
+void rankSeek(struct dirIndex *ix, int which, struct dirEntry *e, struct rankNode **update){
+    struct rankNode *x = ix->rankHead[which];
+    int l;
+
+    for(l = RANK_LEVELS - 1; l >= 0; l--){
+        while(x->next[l] != NULL && rankBefore(x->next[l]->entry, e, which))
+            x = x->next[l];
+        update[l] = x;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: rankInsert()
+ * ** Description: Links an entry into a rank list, with a random
+ *      height (each level a quarter as likely as the one below).
+ * ** Parameters: The index, which rank list, the entry.
+ * ** Pre-Conditions: The entry isn't in the list.
+ * ** Post-Conditions: e->rank[which] is its node, or NULL if memory
+ *      ran out.
+ * *********************************************************************/
+void rankInsert(struct dirIndex *ix, int which, struct dirEntry *e){
+    struct rankNode *update[RANK_LEVELS], *node;
+    int levels = 1, l;
+
+    while(levels < RANK_LEVELS && (random() & 3) == 0) levels++;
+    node = malloc(sizeof(*node) + levels * sizeof(node));
+    e->rank[which] = node;
+    if(node == NULL) return;
+    node->entry = e;
+    node->levels = levels;
+    rankSeek(ix, which, e, update);
+    for(l = 0; l < levels; l++){
+        node->next[l] = update[l]->next[l];
+        update[l]->next[l] = node;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: rankRemove()
+ * ** Description: Unlinks an entry from a rank list.
+ * ** Parameters: The index, which rank list, the entry.
+ * ** Pre-Conditions: The entry's size and mtime are the ones it was
+ *      inserted with.
+ * ** Post-Conditions: The node is freed and e->rank[which] is NULL.
+ * *********************************************************************/
+void rankRemove(struct dirIndex *ix, int which, struct dirEntry *e){
+    struct rankNode *update[RANK_LEVELS], *node = e->rank[which];
+    int l;
+
+    if(node == NULL) return;
+    rankSeek(ix, which, e, update);
+    for(l = 0; l < node->levels; l++)
+        update[l]->next[l] = node->next[l];
+    free(node);
+    e->rank[which] = NULL;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexUpdate()
+ * ** Description: Stats one name and stores the result in the index,
+ *      or drops the name if it no longer exists.
+ * ** Parameters: The index, the file name.
+ * ** Pre-Conditions: The index must have buckets.
+ * ** Post-Conditions: Returns the name's entry, or NULL if it's gone
+ *      (or couldn't be stored). A new name past maxEntries sets
+ *      overBudget instead.
+ * *********************************************************************/
+struct dirEntry *indexUpdate(struct dirIndex *ix, const char *name){
+    struct dirEntry **slot = indexSlot(ix, name), *e = *slot;
+    struct stat st, lst;
+
+    if(!validName(name) || stat(name, &st) < 0){
+        if(e != NULL){
+            rankRemove(ix, RANK_SIZE, e);
+            rankRemove(ix, RANK_MTIME, e);
+            *slot = e->next;
+            free(e);
+            ix->count--;
+        }
+        return NULL;
+    }
+    if(e == NULL){
+        if(ix->maxEntries > 0 && ix->count >= ix->maxEntries){
+            ix->overBudget = 1;
+            return NULL;
+        }
+        if(ix->count >= ix->numBuckets){
+            indexGrow(ix);
+            slot = indexSlot(ix, name);
+        }
+        e = malloc(sizeof(*e) + strlen(name) + 1);
+        if(e == NULL) return NULL;
+        strcpy(e->name, name);
+        e->next = NULL;
+        e->rank[RANK_SIZE] = e->rank[RANK_MTIME] = NULL;
+        e->type = 0;
+        *slot = e;
+        ix->count++;
+    }
+    long long mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    char type = S_ISREG(st.st_mode) ? 'f' : S_ISDIR(st.st_mode) ? 'd' : 'o';
+    e->link = lstat(name, &lst) == 0 && S_ISLNK(lst.st_mode);
+    if(e->type == type && e->size == st.st_size && e->mtime == mtime)
+        return e;
+
+    //Changed: move it in the rank lists
+    rankRemove(ix, RANK_SIZE, e);
+    rankRemove(ix, RANK_MTIME, e);
+    e->size = st.st_size;
+    e->mtime = mtime;
+    e->type = type;
+    if(type == 'f'){
+        rankInsert(ix, RANK_SIZE, e);
+        rankInsert(ix, RANK_MTIME, e);
+    }
+    return e;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexClear()
+ * ** Description: Frees every entry and rank node in the index.
+ * ** Parameters: The index.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The index is empty; its buckets, rank list
+ *      heads and watch are kept.
+ * *********************************************************************/
+void indexClear(struct dirIndex *ix){
+    struct dirEntry *e, *next;
+    long i;
+
+    for(i = 0; i < ix->numBuckets; i++){
+        for(e = ix->buckets[i]; e != NULL; e = next){
+            next = e->next;
+            free(e->rank[RANK_SIZE]);
+            free(e->rank[RANK_MTIME]);
+            free(e);
+        }
+        ix->buckets[i] = NULL;
+    }
+    ix->count = 0;
+    for(i = 0; i < RANKS; i++)
+        if(ix->rankHead[i] != NULL)
+            memset(ix->rankHead[i]->next, 0, RANK_LEVELS * sizeof(struct rankNode *));
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexDrop()
+ * ** Description: Gives up on an index whose directory outgrew its
+ *      budget, freeing its memory and watch.
+ * ** Parameters: The index.
+ * ** Pre-Conditions: overBudget is set.
+ * ** Post-Conditions: The index stays empty. Returns -1.
+ * *********************************************************************/
+int indexDrop(struct dirIndex *ix){
+    fprintf(stderr, "Directory has over %ld entries, not indexing it.\n", ix->maxEntries);
+    indexClear(ix);
+    if(ix->watchFD >= 0) close(ix->watchFD);
+    ix->watchFD = -1;
+    return -1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexBuild()
+ * ** Description: (Re)builds the index, and its rank lists, from a
+ *      full directory scan. The inotify watch is set up first, so
+ *      nothing that changes during the scan is missed.
+ * ** Parameters: The index.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0 with the index current, or -1 if the
+ *      directory can't be watched or has more than maxEntries
+ *      entries, in which case lookups fall back to stat().
+ * *********************************************************************/
+int indexBuild(struct dirIndex *ix){
+    struct dirent *dir;
+    long i;
+
+    indexClear(ix);
+    if(ix->numBuckets == 0) indexGrow(ix);
+    for(i = 0; i < RANKS; i++){
+        if(ix->rankHead[i] == NULL)
+            ix->rankHead[i] = calloc(1, sizeof(struct rankNode) + RANK_LEVELS * sizeof(struct rankNode *));
+        if(ix->rankHead[i] == NULL) return -1;
+    }
+
+    if(ix->watchFD < 0){
+        ix->watchFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(ix->watchFD < 0 || inotify_add_watch(ix->watchFD, ".", IN_CREATE | IN_DELETE
+                    | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB) < 0){
+            perror("ERROR watching directory for the index");
+            if(ix->watchFD >= 0) close(ix->watchFD);
+            ix->watchFD = -1;
+            return -1;
+        }
+    }
+    DIR *d = opendir(".");
+    if(d == NULL) return 0;
+    while((dir = readdir(d)) != NULL && !ix->overBudget)
+        indexUpdate(ix, dir->d_name);
+    closedir(d);
+    return ix->overBudget ? indexDrop(ix) : 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexSync()
+ * ** Description: Brings the index up to date: builds it on first
+ *      use, then applies the directory's queued inotify events by
+ *      re-stating each name they mention. Never blocks.
+ * ** Parameters: The index.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0 if the index is current, -1 if it
+ *      isn't usable.
+ * *********************************************************************/
+int indexSync(struct dirIndex *ix){
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *last = NULL;
+    int n, i;
+
+    if(ix->overBudget) return -1;
+    if(ix->watchFD < 0) return indexBuild(ix);
+    while((n = read(ix->watchFD, events, sizeof(events))) > 0){
+        for(i = 0; i < n; ){
+            struct inotify_event *ev = (struct inotify_event *) (events + i);
+            if(ev->mask & IN_Q_OVERFLOW) return indexBuild(ix);
+            //A write shows up as a run of events for one name
+            if(ev->len > 0 && (last == NULL || strcmp(last, ev->name) != 0))
+                indexUpdate(ix, ev->name);
+            last = ev->len > 0 ? ev->name : NULL;
+            i += sizeof(*ev) + ev->len;
+        }
+        last = NULL;
+    }
+    return ix->overBudget ? indexDrop(ix) : 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: indexStat()
+ * ** Description: Looks a name up in the index, which answers without
+ *      a system call for anything but symlinks. If the index can't
+ *      be kept, stats the name directly.
+ * ** Parameters: The index, the file name, where to put the result.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 0 with *out filled in (name excluded),
+ *      or -1 if the name doesn't exist in the served directory.
+ * *********************************************************************/
+int indexStat(struct dirIndex *ix, const char *name, struct dirEntry *out){
+    struct dirEntry *e;
+    struct stat st;
+
+    if(!validName(name)) return -1;
+    if(indexSync(ix) < 0){
+        if(stat(name, &st) < 0) return -1;
+        out->size = st.st_size;
+        out->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        out->type = S_ISREG(st.st_mode) ? 'f' : S_ISDIR(st.st_mode) ? 'd' : 'o';
+        return 0;
+    }
+    e = *indexSlot(ix, name);
+    if(e != NULL && e->link) e = indexUpdate(ix, name);
+    if(e == NULL) return -1;
+    out->size = e->size;
+    out->mtime = e->mtime;
+    out->type = e->type;
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendStat()
+ * ** Description: Answers "-s name [len]" with the file's size, mtime
+ *      (in nanoseconds) and content hash, so a relay or follower can
+ *      tell whether its copy is current without transferring the
+ *      file. With len, the hash covers only the first len bytes,
+ *      which lets a follower check that its copy is a prefix.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-s ".
+ * ** Post-Conditions: Sends "sta <size> <mtime> <hash>", or "nof" if
+ *      the name isn't a regular file in the directory.
+ * *********************************************************************/
+void sendStat(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+    char msg[BUFFER_SIZE];
+    struct stat st;
+
+    if(argc < 2 || argc > 3 || !validName(args[1]) || stat(args[1], &st) < 0 || !S_ISREG(st.st_mode)){
+        sendMsg(socketFD, "nof\n");
+        free(cmd);
+        return;
+    }
+    printf("Stat of \"%s\" requested on port %i.\n", args[1], portNum);
+    snprintf(msg, sizeof(msg), "sta %lld %lld %016llx\n", (long long) st.st_size,
+            st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+            fileHash(args[1], &st, argc == 3 ? atoll(args[2]) : -1));
+    sendMsg(socketFD, msg);
+    free(cmd);
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendStats()
+ * ** Description: Answers "-stats", a batch stat: after "bst" the
+ *      client sends names on the data connection, one per line,
+ *      and shuts down its side when done. Each name is answered with
+ *      a line "<type> <size> <mtime> <name>", type being f (regular
+ *      file), d (directory), o (other) or - (doesn't exist, size and
+ *      mtime 0). Answers come from the directory index, in request
+ *      order, and are written whenever the names read so far are
+ *      used up, so the client can stream as many names as it likes.
+ *      A name longer than NAME_MAX can't exist, and is answered
+ *      "- 0 0 " without being echoed.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      data port number.
+ * ** Pre-Conditions: The command must be "-stats".
+ * ** Post-Conditions: Every complete line received has been answered.
+ *      A name longer than RECV_CHUNK ends the request.
+ * *********************************************************************/
+void sendStats(int socketFD, int portNum){
+    char *in = malloc(RECV_CHUNK), *out = malloc(RECV_CHUNK);
+    int have = 0, used = 0, done = 0, n;
+    long long count = 0;
+    struct dirEntry e;
+
+    printf("Batch stat requested on port %i.\n", portNum);
+    sendMsg(socketFD, "bst\n");
+    while(!done && in != NULL && out != NULL){
+        //Read more names; at the end, answer a last unterminated one
+        n = ioRead(socketFD, in + have, RECV_CHUNK - have);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0){
+            perror("ERROR reading names");
+            break;
+        }
+        if(n == 0){
+            if(have == RECV_CHUNK) break;
+            in[have++] = '\n';
+            done = 1;
+        }
+        have += n;
+
+        char *line = in, *end;
+        while((end = memchr(line, '\n', in + have - line)) != NULL){
+            *end = '\0';
+            if(end > line){
+                //Leave room for the longest answer line
+                if(used > RECV_CHUNK - NAME_MAX - 64){
+                    if(ioWrite(socketFD, out, used) < 0) done = 2;
+                    used = 0;
+                }
+                if(end - line > NAME_MAX)
+                    n = snprintf(out + used, RECV_CHUNK - used, "- 0 0 \n");
+                else if(indexStat(&cwdRoot->index, line, &e) < 0)
+                    n = snprintf(out + used, RECV_CHUNK - used, "- 0 0 %s\n", line);
+                else
+                    n = snprintf(out + used, RECV_CHUNK - used, "%c %lld %lld %s\n",
+                            e.type, e.size, e.mtime, line);
+                if(n < 0 || n >= RECV_CHUNK - used){
+                    fprintf(stderr, "ERROR, batch stat answer too long\n");
+                    done = 2;
+                    break;
+                }
+                used += n;
+                count++;
+            }
+            line = end + 1;
+        }
+        have -= line - in;
+        memmove(in, line, have);
+        if(have == RECV_CHUNK){
+            fprintf(stderr, "ERROR, name too long in batch stat\n");
+            break;
+        }
+
+        //Names read so far are answered; send before waiting for more
+        if(used > 0 && done != 2 && ioWrite(socketFD, out, used) < 0) done = 2;
+        used = 0;
+    }
+    printf("Batch stat answered %lld names.\n", count);
+    free(in);
+    free(out);
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendQuery()
+ * ** Description: Answers the rank queries over regular files:
+ *          "-top size N"       the N largest
+ *          "-top mtime N"      the N most recently modified
+ *          "-range FROM [TO]"  modified from FROM to TO (nanoseconds
+ *                              since the epoch; TO defaults to no
+ *                              limit), newest first
+ *      using the index's rank lists, so the work is a skip list
+ *      search plus one step per file sent.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-top " or
+ *      "-range ".
+ * ** Post-Conditions: Sends "qry" and then one line per file in the
+ *      "-stats" format, or "err" for a bad query or an unusable
+ *      index.
+ * *********************************************************************/
+void sendQuery(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+    int top = strcmp(args[0], "-top") == 0, which = RANK_MTIME, used = 0;
+    long long limit = -1, from = 0, to = -1;
+    char *out = malloc(RECV_CHUNK);
+    struct rankNode *node;
+
+    if(top && argc == 3 && (strcmp(args[1], "size") == 0 || strcmp(args[1], "mtime") == 0)){
+        which = strcmp(args[1], "size") == 0 ? RANK_SIZE : RANK_MTIME;
+        limit = atoll(args[2]);
+    }
+    else if(!top && (argc == 2 || argc == 3)){
+        from = atoll(args[1]);
+        to = argc == 3 ? atoll(args[2]) : -1;
+    }
+    else
+        limit = -2;
+    if(limit == -2 || (top && limit < 0) || out == NULL || indexSync(&cwdRoot->index) < 0){
+        sendMsg(socketFD, "err\n");
+        free(cmd);
+        free(out);
+        return;
+    }
+    printf("Query \"%s\" requested on port %i.\n", buffer, portNum);
+    sendMsg(socketFD, "qry\n");
+
+    //Ranges skip down to the newest file not after TO
+    node = cwdRoot->index.rankHead[which];
+    if(to >= 0){
+        int l;
+        for(l = RANK_LEVELS - 1; l >= 0; l--)
+            while(node->next[l] != NULL && node->next[l]->entry->mtime > to)
+                node = node->next[l];
+    }
+    for(node = node->next[0]; node != NULL && limit != 0; node = node->next[0]){
+        struct dirEntry *e = node->entry;
+        if(!top && e->mtime < from) break;
+        if(used > RECV_CHUNK - (int) strlen(e->name) - 64){
+            if(ioWrite(socketFD, out, used) < 0) break;
+            used = 0;
+        }
+        used += sprintf(out + used, "%c %lld %lld %s\n", e->type, e->size, e->mtime, e->name);
+        if(limit > 0) limit--;
+    }
+    if(used > 0) ioWrite(socketFD, out, used);
+    free(cmd);
+    free(out);
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendRange()
+ * ** Description: Answers "-r offset name" by sending the file from
+ *      the given byte offset on, so a follower whose copy is a prefix
+ *      of the file only transfers what was appended.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-r ".
+ * ** Post-Conditions: Sends "fil size" and the rest of the file, or "nof".
+ * *********************************************************************/
+void sendRange(char *buffer, int socketFD, int portNum){
+    char *cmd = strdup(buffer);
+    char *args[MAX_ARGS];
+    int argc = splitArgs(cmd, args, MAX_ARGS);
+
+    if(argc != 3 || !validName(args[2]) || inDir(args[2]) == 0){
+        sendMsg(socketFD, "nof\n");
+        free(cmd);
+        return;
+    }
+    sendFileIntent(socketFD, args[2], atoll(args[1]));
+    sendFile(args[2], atoll(args[1]), socketFD, portNum);
+    free(cmd);
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendProbe()
+ * ** Description: Answers "-probe bytes" by streaming that many bytes
+ *      of generated data, so link throughput can be measured without
+ *      the disk. The data comes from a buffer filled once, and goes
+ *      out in the same BUFFER_SIZE writes sendFile() makes.
+ * ** Parameters: The command buffer, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The command must start with "-probe ".
+ * ** Post-Conditions: Sends "prb bytes" and the data, or "err" for a
+ *      bad size. The server's own throughput is printed. Stops early
+ *      if the request's deadline can't be met.
+ * *********************************************************************/
+void sendProbe(char *buffer, int socketFD, int portNum){
+    static char data[RECV_CHUNK];
+    long long total = parseSize(buffer + 7), sent = 0, start;
+    char reply[BUFFER_SIZE];
+    int i;
+
+    if(total <= 0){
+        sendMsg(socketFD, "err\n");
+        return;
+    }
+    if(data[0] == 0)
+        for(i = 0; i < RECV_CHUNK; i++)
+            data[i] = 'a' + i % 26;
+
+    printf("Probe of %lld bytes requested on port %i.\n", total, portNum);
+    snprintf(reply, sizeof(reply), "prb %lld\n", total);
+    sendMsg(socketFD, reply);
+    start = nowUsec();
+    while(sent < total){
+        int len = total - sent < BUFFER_SIZE ? total - sent : BUFFER_SIZE;
+        int success = ioWrite(socketFD, data + sent % (RECV_CHUNK - BUFFER_SIZE), len);
+        if(success < 0){
+            perror("ERROR writing probe to socket");
+            return;
+        }
+        __atomic_add_fetch(&metrics->bytesSent, success, __ATOMIC_RELAXED);
+        bytesSentHere += success;
+        sent += success;
+        if(requestDeadline != 0 && transferLate(sent, total, start)){
+            printf("Stopping probe, it can't meet its deadline.\n");
+            return;
+        }
+    }
+    long long usec = nowUsec() - start;
+    printf("Probe sent %lld bytes in %.3f s (%.1f MB/s).\n", sent, usec / 1e6,
+            usec > 0 ? sent / (double) usec : 0);
+}
+
+
+
+/*********************************************************************
+ * ** Function: recvSink()
+ * ** Description: Answers "-sink" by reading and discarding whatever
+ *      the client sends on the data connection until it shuts down
+ *      its side, for measuring upload throughput without the disk.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      data port number.
+ * ** Pre-Conditions: The command must start with "-sink".
+ * ** Post-Conditions: Sends "snk", then after the upload
+ *      "ok bytes usec" with what the server received and how long
+ *      it took. The server's own throughput is printed.
+ * *********************************************************************/
+void recvSink(int socketFD, int portNum){
+    static char data[RECV_CHUNK];
+    long long got = 0, start, usec;
+    char reply[BUFFER_SIZE];
+    int n;
+
+    printf("Sink requested on port %i.\n", portNum);
+    sendMsg(socketFD, "snk\n");
+    start = nowUsec();
+    while((n = ioRead(socketFD, data, RECV_CHUNK)) != 0){
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0){
+            perror("ERROR reading upload");
+            return;
+        }
+        got += n;
+    }
+    usec = nowUsec() - start;
+    printf("Sink received %lld bytes in %.3f s (%.1f MB/s).\n", got, usec / 1e6,
+            usec > 0 ? got / (double) usec : 0);
+    snprintf(reply, sizeof(reply), "ok %lld %lld\n", got, usec);
+    sendMsg(socketFD, reply);
+}
+
+
+
+/*********************************************************************
+ * ** Function: peerRequest()
+ * ** Description: Makes a request to another ftserver (a relay's
+ *      upstream or a follower's leader) the same way ftclient.py
+ *      does: sends the command and a data port on a control
+ *      connection, then accepts the peer's connection back to that
+ *      port.
+ * ** Parameters: The peer's host and port, the command to send, a
+ *      BUFFER_SIZE buffer to receive the peer's first reply message.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the data connection's file descriptor,
+ *      positioned after the reply message, or -1 if the peer couldn't
+ *      be reached.
+ * *********************************************************************/
+int peerRequest(const char *host, const char *port, const char *cmd, char *reply){
+    struct addrinfo hints, *res = NULL;
+    int ctrlFD = -1, listenFD = -1, dataFD = -1;
+    int dataPort;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    createSocket(&ctrlFD);
+    if(currentCo != NULL) fcntl(ctrlFD, F_SETFL, O_NONBLOCK);
+    if(ioConnect(ctrlFD, res->ai_addr, res->ai_addrlen) < 0
+            || (listenFD = openEphemeral(&dataPort)) < 0){
+        freeaddrinfo(res);
+        close(ctrlFD);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    //Send the request and our data port, then wait for the peer
+    sendMsg(ctrlFD, cmd);
+    snprintf(reply, BUFFER_SIZE, "%i", dataPort);
+    sendMsg(ctrlFD, reply);
+    dataFD = ioAccept(listenFD, PUSH_TIMEOUT);
+    close(listenFD);
+    close(ctrlFD);
+    if(dataFD < 0) return -1;
+
+    struct timeval tv = { PUSH_TIMEOUT, 0 };
+    setsockopt(dataFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if(readFull(dataFD, reply, BUFFER_SIZE) != BUFFER_SIZE){
+        close(dataFD);
+        return -1;
+    }
+    reply[BUFFER_SIZE - 1] = '\0';
+    return dataFD;
+}
+
+
+
+/*********************************************************************
+ * ** Function: peerStat()
+ * ** Description: Asks another ftserver for a file's current size,
+ *      mtime and hash (of the whole file, or of its first len bytes).
+ * ** Parameters: The peer's host and port, the file name, the prefix
+ *      length to hash (-1 for the whole file), addresses to receive
+ *      the size, mtime and hash.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns 1 if the peer has the file, 0 if it
+ *      doesn't, or -1 if the peer couldn't be asked.
+ * *********************************************************************/
+int peerStat(const char *host, const char *port, const char *name, long long len,
+        long long *size, long long *mtime, unsigned long long *hash){
+    char cmd[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+
+    if(len < 0) snprintf(cmd, sizeof(cmd), "-s %s", name);
+    else snprintf(cmd, sizeof(cmd), "-s %s %lld", name, len);
+    int dataFD = peerRequest(host, port, cmd, reply);
+    if(dataFD < 0) return -1;
+    close(dataFD);
+    if(strncmp(reply, "nof", 3) == 0) return 0;
+    if(sscanf(reply, "sta %lld %lld %llx", size, mtime, hash) != 3) return -1;
+    return 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: cacheValid()
+ * ** Description: Checks whether the cached copy of a file is the
+ *      version the upstream currently has, by comparing the size,
+ *      mtime and hash recorded when it was fetched.
+ * ** Parameters: The cached file's path, its metadata path, and the
+ *      upstream's size, mtime and hash.
+ * ** Pre-Conditions: The caller must hold the entry's lock.
+ * ** Post-Conditions: Returns true if the cached copy can be served.
+ * *********************************************************************/
+int cacheValid(const char *path, const char *metaPath, long long size,
+        long long mtime, unsigned long long hash){
+    long long cSize, cMtime;
+    unsigned long long cHash;
+    struct stat st;
+    int valid = 0;
+
+    FILE *meta = fopen(metaPath, "r");
+    if(meta == NULL) return 0;
+    if(fscanf(meta, "%lld %lld %llx", &cSize, &cMtime, &cHash) == 3)
+        valid = cSize == size && cMtime == mtime && cHash == hash;
+    fclose(meta);
+    return valid && stat(path, &st) == 0 && st.st_size == size;
+}
+
+
+
+/*********************************************************************
+ * ** Function: cacheFetch()
+ * ** Description: Downloads a file from the upstream into the cache.
+ *      The data is written to a temporary file and only moved into
+ *      place once its size and hash match what the upstream reported,
+ *      so a file that changed mid-transfer is never cached.
+ * ** Parameters: The file name, the cache paths for the temporary
+ *      file, the cached file and its metadata, and the expected size,
+ *      mtime and hash.
+ * ** Pre-Conditions: The caller must hold the entry's lock.
+ * ** Post-Conditions: Returns 0 if the cached copy is now current,
+ *      -1 otherwise.
+ * *********************************************************************/
+int cacheFetch(const char *name, const char *tmpPath, const char *path, const char *metaPath,
+        long long size, long long mtime, unsigned long long hash){
+    char reply[BUFFER_SIZE];
+    unsigned long long h = FNV_OFFSET;
+    long long total = 0;
+    int ok = 1;
+
+    int dataFD = peerRequest(upstreamHost, upstreamPort, name, reply);
+    if(dataFD < 0) return -1;
+    int outFD = strncmp(reply, "fil", 3) == 0 ? open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if(outFD < 0){
+        close(dataFD);
+        return -1;
+    }
+
+    char *data = malloc(RECV_CHUNK);
+    while(1){
+        int n = ioReadWithin(dataFD, data, RECV_CHUNK, PUSH_TIMEOUT);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            ok = n == 0;
+            break;
+        }
+        h = hashBytes(h, data, n);
+        total += n;
+        if(write(outFD, data, n) != n){
+            ok = 0;
+            break;
+        }
+    }
+    free(data);
+    close(dataFD);
+    if(close(outFD) < 0) ok = 0;
+
+    if(!ok || total != size || h != hash || rename(tmpPath, path) < 0){
+        printf("Upstream copy of \"%s\" changed or failed mid-transfer.\n", name);
+        unlink(tmpPath);
+        return -1;
+    }
+
+    //Record the version the cached copy corresponds to
+    FILE *meta = fopen(tmpPath, "w");
+    if(meta == NULL) return -1;
+    fprintf(meta, "%lld %lld %016llx\n", size, mtime, hash);
+    if(fclose(meta) != 0 || rename(tmpPath, metaPath) < 0){
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+//One cached file, as seen by evictCache()
+struct cacheEntry {
+    char name[256];
+    long long size;
+    long long used;
+};
+
+
+
+/*********************************************************************
+ * ** Function: compareAge()
+ * ** Description: qsort() comparison putting least recently used
+ *      cache entries first.
+ * ** Parameters: Pointers to two cacheEntry structs.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns <0, 0 or >0 as a was used before, at
+ *      the same time as, or after b.
+ * *********************************************************************/
+int compareAge(const void *a, const void *b){
+    long long x = ((const struct cacheEntry *) a)->used;
+    long long y = ((const struct cacheEntry *) b)->used;
+    return (x > y) - (x < y);
+}
+
+
+
+/*********************************************************************
+ * ** Function: evictCache()
+ * ** Description: Deletes least recently used cache entries until the
+ *      cache fits in cacheMax bytes. An entry's mtime records its last
+ *      use. Entries another request holds locked are skipped.
+ * ** Parameters: The name of an entry that must be kept (the one just
+ *      fetched), or NULL.
+ * ** Pre-Conditions: Relay mode must be enabled.
+ * ** Post-Conditions: The cache is at most cacheMax bytes, unless the
+ *      kept or busy entries alone exceed it.
+ * *********************************************************************/
+void evictCache(const char *keep){
+    char path[BUFFER_SIZE];
+    struct dirent *dir;
+    struct stat st;
+    struct cacheEntry *entries = NULL;
+    int count = 0, cap = 0, i;
+    long long total = 0;
+
+    DIR *d = opendir(cacheDir);
+    if(d == NULL) return;
+    while((dir = readdir(d)) != NULL){
+        //Metadata, locks and partial downloads are all dot-files
+        if(dir->d_name[0] == '.' || strlen(dir->d_name) >= sizeof(entries->name)) continue;
+        snprintf(path, sizeof(path), "%s/%s", cacheDir, dir->d_name);
+        if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if(count == cap){
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, cap * sizeof(*entries));
+        }
+        strcpy(entries[count].name, dir->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    qsort(entries, count, sizeof(*entries), compareAge);
+    for(i = 0; i < count && total > cacheMax; i++){
+        if(keep != NULL && strcmp(entries[i].name, keep) == 0) continue;
+        snprintf(path, sizeof(path), "%s/.%s.lock", cacheDir, entries[i].name);
+        int lockFD = open(path, O_RDWR | O_CREAT, 0644);
+        if(lockFD < 0) continue;
+        if(flock(lockFD, LOCK_EX | LOCK_NB) == 0){
+            snprintf(path, sizeof(path), "%s/%s", cacheDir, entries[i].name);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/.%s.meta", cacheDir, entries[i].name);
+            unlink(path);
+            total -= entries[i].size;
+            printf("Evicted \"%s\" from cache.\n", entries[i].name);
+        }
+        close(lockFD);
+    }
+    free(entries);
+}
+
+
+
+/*********************************************************************
+ * ** Function: relayFile()
+ * ** Description: Serves a file request in relay mode. The upstream
+ *      is asked for the file's current version; a matching cached
+ *      copy is served locally, otherwise the file is fetched into the
+ *      cache first. Concurrent misses for the same file wait on one
+ *      entry lock, so only the first one fetches. If the upstream is
+ *      unreachable, a cached copy is served as-is.
+ * ** Parameters: The requested file name (in the command buffer), the
+ *      data connection's socket file descriptor, the data port number.
+ * ** Pre-Conditions: Relay mode must be enabled.
+ * ** Post-Conditions: Sends the file, "nof", or "err" if the file
+ *      couldn't be fetched. Lock files are left in place, since
+ *      removing one could let two requests lock different files.
+ * *********************************************************************/
+void relayFile(char *buffer, int socketFD, int portNum){
+    char name[BUFFER_SIZE], path[BUFFER_SIZE], metaPath[BUFFER_SIZE];
+    char lockPath[BUFFER_SIZE], tmpPath[BUFFER_SIZE];
+    long long size = 0, mtime = 0;
+    unsigned long long hash = 0;
+    int fresh = 0;
+
+    strcpy(name, buffer);
+    printf("File \"%s\" requested on port %i (relay).\n", name, portNum);
+    if(!validName(name) || strlen(name) > 200){
+        sendMsg(socketFD, "nof\n");
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, name);
+    snprintf(metaPath, sizeof(metaPath), "%s/.%s.meta", cacheDir, name);
+    snprintf(lockPath, sizeof(lockPath), "%s/.%s.lock", cacheDir, name);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/.%s.tmp", cacheDir, name);
+
+    int found = peerStat(upstreamHost, upstreamPort, name, -1, &size, &mtime, &hash);
+    if(found == 0){
+        //Gone upstream, so drop any cached copy too
+        unlink(path);
+        unlink(metaPath);
+        sendMsg(socketFD, "nof\n");
+        return;
+    }
+    int lockFD = open(lockPath, O_RDWR | O_CREAT, 0644);
+    if(lockFD < 0){
+        sendMsg(socketFD, "err\n");
+        return;
+    }
+    flock(lockFD, LOCK_EX);
+
+    if(found < 0){
+        printf("Upstream unreachable, trying cached copy.\n");
+        fresh = access(path, R_OK) == 0;
+    }
+    else if(cacheValid(path, metaPath, size, mtime, hash)){
+        printf("Cache hit.\n");
+        fresh = 1;
+    }
+    else {
+        printf("Cache miss, fetching from upstream.\n");
+        fresh = cacheFetch(name, tmpPath, path, metaPath, size, mtime, hash) == 0;
+        if(fresh) evictCache(name);
+    }
+
+    //Keep a shared lock while sending so eviction leaves this entry be
+    flock(lockFD, LOCK_SH);
+    if(fresh){
+        utimensat(AT_FDCWD, path, NULL, 0);
+        sendFileIntent(socketFD, path, 0);
+        sendFile(path, 0, socketFD, portNum);
+    }
+    else sendMsg(socketFD, "err\n");
+    close(lockFD);
+}
+
+
+
+/*********************************************************************
+ * ** Function: relayDir()
+ * ** Description: Answers "-l" in relay mode by passing the upstream's
+ *      listing through, since the cache only holds files that have
+ *      been requested.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      data port number.
+ * ** Pre-Conditions: Relay mode must be enabled.
+ * ** Post-Conditions: Sends the upstream's listing, or "err".
+ * *********************************************************************/
+void relayDir(int socketFD, int portNum){
+    char reply[BUFFER_SIZE];
+
+    printf("List directory requested on port %i (relay).\n", portNum);
+    int dataFD = peerRequest(upstreamHost, upstreamPort, "-l", reply);
+    if(dataFD < 0 || strncmp(reply, "dir", 3) != 0){
+        if(dataFD >= 0) close(dataFD);
+        sendMsg(socketFD, "err\n");
+        return;
+    }
+    sendMsg(socketFD, reply);
+    while(readFull(dataFD, reply, BUFFER_SIZE) == BUFFER_SIZE){
+        reply[BUFFER_SIZE - 1] = '\0';
+        sendMsg(socketFD, reply);
+        if(strncmp(reply, "~done", 5) == 0) break;
+    }
+    close(dataFD);
+}
+
+
+
+/*********************************************************************
+ * ** Function: initMetrics()
+ * ** Description: Maps the metrics counters into memory that stays
+ *      shared with every process forked afterwards (change streams,
+ *      the replication process), so "-metrics" sees all of them.
+ * ** Parameters: None
+ * ** Pre-Conditions: Must run before any fork().
+ * ** Post-Conditions: metrics points at zeroed, shared counters.
+ * *********************************************************************/
+void initMetrics(){
+    metrics = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(metrics == MAP_FAILED) error("ERROR mapping metrics");
+}
+
+
+
+/*********************************************************************
+ * ** Function: countOpenFDs()
+ * ** Description: Counts this process's open file descriptors.
+ * ** Parameters: None
+ * ** Pre-Conditions: /proc must be mounted.
+ * ** Post-Conditions: Returns the count, or -1 if /proc is missing.
+ * *********************************************************************/
+long long countOpenFDs(){
+    DIR *d = opendir("/proc/self/fd");
+    struct dirent *dir;
+    long long count = 0;
+
+    if(d == NULL) return -1;
+    while((dir = readdir(d)) != NULL)
+        if(dir->d_name[0] != '.') count++;
+    closedir(d);
+    //Don't count the descriptor used to read the directory
+    return count - 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendMetrics()
+ * ** Description: Answers "-metrics" with one "name value" line per
+ *      counter, ended by "~done" like a directory listing. Per root
+ *      counters are named "counter.root". The
+ *      allocator and file descriptor figures are for the process
+ *      serving clients, for spotting leaks in long runs.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      data port number.
+ * ** Pre-Conditions: initMetrics() must have run.
+ * ** Post-Conditions: The counters are sent to the client.
+ * *********************************************************************/
+void sendMetrics(int socketFD, int portNum){
+    struct serverMetrics m = *metrics;
+    struct mallinfo2 heap = mallinfo2();
+    char line[BUFFER_SIZE];
+    const char *names[] = { "requests", "bytes_sent", "repl_connected", "repl_lag_ms",
+        "repl_pending", "repl_files", "repl_bytes", "repl_delta_saved_bytes",
+        "heap_in_use", "heap_free", "heap_mmapped", "open_fds",
+        "accepts", "cross_cpu_accepts", "interactive_requests", "bulk_requests",
+        "bulk_waiting", "bulk_active", "bulk_processes", "expired_queued",
+        "expired_aborted", "cancelled" };
+    long long values[] = { m.requests, m.bytesSent, m.replConnected, m.replLagMs,
+        m.replPending, m.replFiles, m.replBytes, m.replDeltaSaved,
+        heap.uordblks, heap.fordblks, heap.hblkhd, countOpenFDs(),
+        m.accepts, m.crossCPUAccepts, m.classRequests[CLASS_INTERACTIVE],
+        m.classRequests[CLASS_BULK], m.bulkWaiting, m.bulkActive, m.bulkProcesses,
+        m.expiredQueued, m.expiredAborted, m.cancelled };
+    int i;
+
+    printf("Metrics requested on port %i.\n", portNum);
+    sendMsg(socketFD, "met\n");
+    for(i = 0; i < (int) (sizeof(values) / sizeof(values[0])); i++){
+        snprintf(line, sizeof(line), "%s %lld\n", names[i], values[i]);
+        sendMsg(socketFD, line);
+    }
+    for(i = 0; i < numRoots; i++){
+        snprintf(line, sizeof(line), "root_active.%.*s %lld\n", ROOT_NAME, roots[i].name, m.rootActive[i]);
+        sendMsg(socketFD, line);
+        snprintf(line, sizeof(line), "root_refused.%.*s %lld\n", ROOT_NAME, roots[i].name, m.rootRefused[i]);
+        sendMsg(socketFD, line);
+    }
+    sendMsg(socketFD, "~done\n");
+}
+
+
+
+/*********************************************************************
+ * ** Function: wallNsec()
+ * ** Description: Returns the wall-clock time in nanoseconds, used to
+ *      timestamp changes so followers can measure replication lag.
+ * ** Parameters: None
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the current time.
+ * *********************************************************************/
+long long wallNsec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+
+/*********************************************************************
+ * ** Function: sendChange()
+ * ** Description: Sends one change stream message for a file: "put"
+ *      with its size and mtime if it's a regular file, otherwise
+ *      "del". Temporary dot-files are never announced.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      file name, the time of the change.
+ * ** Pre-Conditions: The stream must have been started by
+ *      streamChanges().
+ * ** Post-Conditions: The message is sent. Returns 0, or -1 if the
+ *      follower can't be written to.
+ * *********************************************************************/
+int sendChange(int socketFD, const char *name, long long when){
+    char msg[BUFFER_SIZE];
+    struct stat st;
+
+    if(!validName(name) || name[0] == '.' || strlen(name) >= MAX_NAME) return 0;
+    if(stat(name, &st) == 0 && S_ISREG(st.st_mode))
+        snprintf(msg, sizeof(msg), "put %lld %lld %lld %s\n", when, (long long) st.st_size,
+                st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, name);
+    else
+        snprintf(msg, sizeof(msg), "del %lld %s\n", when, name);
+    return sendMsg(socketFD, msg);
+}
+
+
+
+/*********************************************************************
+ * ** Function: streamChanges()
+ * ** Description: Serves a follower's "-watch" subscription. Sends a
+ *      "put" for every file (the snapshot), then "syn", then a "put"
+ *      or "del" as each file is written, renamed or deleted, plus a
+ *      "hb" heartbeat every second while nothing changes.
+ * ** Parameters: The data connection's socket file descriptor, the
+ *      data port number.
+ * ** Pre-Conditions: Runs in its own process (see handleRequest()),
+ *      since it only returns when the follower disconnects.
+ * ** Post-Conditions: The process exits as soon as a message to the
+ *      follower fails, i.e. once it's gone.
+ * *********************************************************************/
+void streamChanges(int socketFD, int portNum){
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct dirent *dir;
+    char msg[BUFFER_SIZE];
+
+    //Watch before listing so no change falls between the two
+    int watchFD = inotify_init1(IN_CLOEXEC);
+    if(watchFD < 0 || inotify_add_watch(watchFD, ".", IN_CLOSE_WRITE | IN_ATTRIB
+                | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+        error("ERROR watching directory");
+    printf("Streaming changes on port %i.\n", portNum);
+
+    if(sendMsg(socketFD, "wch\n") < 0) exit(0);
+    DIR *d = opendir(".");
+    if(d == NULL) error("ERROR opening directory");
+    while((dir = readdir(d)) != NULL)
+        if(sendChange(socketFD, dir->d_name, wallNsec()) < 0) exit(0);
+    closedir(d);
+    if(sendMsg(socketFD, "syn\n") < 0) exit(0);
+
+    struct pollfd pfd = { watchFD, POLLIN, 0 };
+    while(1){
+        if(poll(&pfd, 1, 1000) <= 0){
+            snprintf(msg, sizeof(msg), "hb %lld\n", wallNsec());
+            if(sendMsg(socketFD, msg) < 0) exit(0);
+            continue;
+        }
+        int n = read(watchFD, events, sizeof(events));
+        int i = 0;
+        while(n > 0 && i < n){
+            struct inotify_event *ev = (struct inotify_event *) (events + i);
+            if(ev->mask & IN_Q_OVERFLOW) error("ERROR change stream overflowed");
+            if(ev->len > 0 && sendChange(socketFD, ev->name, wallNsec()) < 0) exit(0);
+            i += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: closeInherited()
+ * ** Description: Closes every descriptor a forked helper inherited
+ *      except the standard streams and the one it works on: the
+ *      listener, control connections, other sessions' sockets, the
+ *      epoll instance and the like. Otherwise a helper that outlives
+ *      the server keeps its port listening with nobody accepting.
+ * ** Parameters: The descriptor to keep.
+ * ** Pre-Conditions: Called in the child right after fork().
+ * ** Post-Conditions: Only 0, 1, 2 and keepFD are open.
+ * *********************************************************************/
+void closeInherited(int keepFD){
+    if(keepFD > 3) close_range(3, keepFD - 1, 0);
+    else if(keepFD < 3) keepFD = 2;
+    close_range(keepFD + 1, ~0U, 0);
+    accessLogFD = -1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: replicateFile()
+ * ** Description: Brings one file up to date with the leader. If the
+ *      local copy is a prefix of the leader's (checked by hash), only
+ *      the appended bytes are fetched; otherwise the whole file is.
+ *      The result is built under a temporary name, given the leader's
+ *      mtime, and renamed into place.
+ * ** Parameters: The file name, the leader's size and mtime for it.
+ * ** Pre-Conditions: Runs in a fetch process started by
+ *      followLeader().
+ * ** Post-Conditions: Returns 0 if the local copy now matches, 1 if
+ *      the leader no longer has the file, -1 on any other failure.
+ * *********************************************************************/
+int replicateFile(const char *name, long long size, long long mtime){
+    char tmpName[BUFFER_SIZE], cmd[BUFFER_SIZE], reply[BUFFER_SIZE];
+    struct stat st;
+    long long offset = 0, total = 0;
+    long long lSize, lMtime;
+    unsigned long long lHash;
+    int ok = 1;
+
+    snprintf(tmpName, sizeof(tmpName), ".%s.repl", name);
+
+    //Delta: keep the local copy if the leader's file starts with it
+    if(stat(name, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < size
+            && peerStat(leaderHost, leaderPort, name, st.st_size, &lSize, &lMtime, &lHash) == 1
+            && lHash == fileHash(name, &st, -1)
+            && copyFile(name, tmpName, 0) == st.st_size)
+        offset = st.st_size;
+
+    snprintf(cmd, sizeof(cmd), "-r %lld %s", offset, name);
+    int dataFD = peerRequest(leaderHost, leaderPort, cmd, reply);
+    if(dataFD < 0) return -1;
+    if(strncmp(reply, "nof", 3) == 0){
+        close(dataFD);
+        unlink(tmpName);
+        return 1;
+    }
+    int outFD = strncmp(reply, "fil", 3) == 0
+        ? open(tmpName, O_WRONLY | O_CREAT | (offset ? O_APPEND : O_TRUNC), 0644) : -1;
+    if(outFD < 0){
+        close(dataFD);
+        unlink(tmpName);
+        return -1;
+    }
+
+    char *data = malloc(RECV_CHUNK);
+    while(1){
+        int n = read(dataFD, data, RECV_CHUNK);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            ok = n == 0;
+            break;
+        }
+        if(write(outFD, data, n) != n){
+            ok = 0;
+            break;
+        }
+        total += n;
+    }
+    free(data);
+    close(dataFD);
+
+    //Carry the leader's mtime over so the next comparison matches
+    struct timespec times[2] = { { 0, UTIME_NOW }, { mtime / 1000000000LL, mtime % 1000000000LL } };
+    if(futimens(outFD, times) < 0) ok = 0;
+    if(close(outFD) < 0) ok = 0;
+    if(!ok || offset + total != size || rename(tmpName, name) < 0){
+        unlink(tmpName);
+        return -1;
+    }
+    __atomic_add_fetch(&metrics->replFiles, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->replBytes, total, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->replDeltaSaved, offset, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+
+//A change from the leader that hasn't been applied yet
+struct replJob {
+    char name[MAX_NAME];
+    long long size;
+    long long mtime;
+    long long when;
+    int deleted;
+    pid_t pid; //Fetch process, or 0 while queued
+    int failures; //Failed fetches so far
+    long long retryAt; //nowUsec() time before which it isn't retried
+};
+
+
+
+/*********************************************************************
+ * ** Function: followLeader()
+ * ** Description: Keeps the served directory a replica of the
+ *      leader's. Subscribes to the leader's change stream ("-watch")
+ *      and queues every file that differs in size or mtime, fetching
+ *      up to followJobs of them at once in separate processes. A
+ *      change to a file already being fetched is queued behind it.
+ *      A failed fetch is retried with a growing backoff, unless a
+ *      newer change to the file is queued or the leader no longer
+ *      has it, when it's dropped. Files the leader no longer has are
+ *      deleted. Replication lag
+ *      (age of the oldest unapplied change) and queue depth are kept
+ *      in the metrics.
+ * ** Parameters: None
+ * ** Pre-Conditions: Runs in its own process, forked by main().
+ * ** Post-Conditions: Never returns; reconnects if the leader goes
+ *      away.
+ * *********************************************************************/
+void followLeader(){
+    char msg[BUFFER_SIZE], name[BUFFER_SIZE];
+    struct replJob *jobs = NULL;
+    int count = 0, cap = 0, running = 0, i, j;
+    char **seen = NULL;
+    int seenCount = 0, seenCap = 0;
+
+    signal(SIGCHLD, SIG_DFL);
+    while(1){
+        int streamFD = peerRequest(leaderHost, leaderPort, "-watch", msg);
+        if(streamFD < 0 || strncmp(msg, "wch", 3) != 0){
+            if(streamFD >= 0) close(streamFD);
+            sleep(1);
+            continue;
+        }
+        printf("Following leader %s:%s.\n", leaderHost, leaderPort);
+        metrics->replConnected = 1;
+        int syncing = 1;
+
+        struct pollfd pfd = { streamFD, POLLIN, 0 };
+        while(1){
+            //Reap finished fetches. A failed one is dropped if the
+            //leader lost the file or a newer change to it is queued
+            //(which takes over its age), else retried after a backoff.
+            int status;
+            pid_t pid;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+                for(i = 0; i < count && jobs[i].pid != pid; i++);
+                if(i == count) continue;
+                running--;
+                for(j = 0; j < count && !(jobs[j].pid == 0
+                            && strcmp(jobs[j].name, jobs[i].name) == 0); j++);
+                int fetched = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+                int gone = WIFEXITED(status) && WEXITSTATUS(status) == 2;
+                if(gone) printf("Leader no longer has \"%s\".\n", jobs[i].name);
+                if(!fetched && !gone && j == count){
+                    long long wait = (long long) REPL_RETRY_MS << (jobs[i].failures < 16 ? jobs[i].failures : 16);
+                    jobs[i].failures++;
+                    jobs[i].retryAt = nowUsec() + (wait < REPL_RETRY_MAX_MS ? wait : REPL_RETRY_MAX_MS) * 1000;
+                    jobs[i].pid = 0;
+                    continue;
+                }
+                if(j < count && jobs[i].when < jobs[j].when) jobs[j].when = jobs[i].when;
+                jobs[i] = jobs[--count];
+            }
+
+            //Start queued jobs, oldest first, one per file at a time
+            long long now = nowUsec();
+            for(i = 0; i < count && running < followJobs; i++){
+                if(jobs[i].pid != 0 || jobs[i].retryAt > now) continue;
+                for(j = 0; j < count && !(jobs[j].pid != 0
+                            && strcmp(jobs[j].name, jobs[i].name) == 0); j++);
+                if(j < count) continue;
+                if(jobs[i].deleted){
+                    unlink(jobs[i].name);
+                    jobs[i--] = jobs[--count];
+                    continue;
+                }
+                fflush(stdout);
+                pid = fork();
+                if(pid == 0){
+                    int result = replicateFile(jobs[i].name, jobs[i].size, jobs[i].mtime);
+                    exit(result == 0 ? 0 : result == 1 ? 2 : 1);
+                }
+                if(pid > 0){
+                    jobs[i].pid = pid;
+                    running++;
+                }
+            }
+
+            //Lag is the age of the oldest change not yet applied
+            long long oldest = 0;
+            for(i = 0; i < count; i++)
+                if(oldest == 0 || jobs[i].when < oldest) oldest = jobs[i].when;
+            metrics->replLagMs = oldest ? (wallNsec() - oldest) / 1000000 : 0;
+            metrics->replPending = count;
+
+            if(poll(&pfd, 1, 100) <= 0) continue;
+            if(readFull(streamFD, msg, BUFFER_SIZE) != BUFFER_SIZE) break;
+            msg[BUFFER_SIZE - 1] = '\0';
+            msg[strcspn(msg, "\n")] = '\0';
+
+            struct replJob job;
+            bzero(&job, sizeof(job));
+            int off = 0;
+            if(sscanf(msg, "put %lld %lld %lld %n", &job.when, &job.size, &job.mtime, &off) == 3 && off > 0)
+                strcpy(name, msg + off);
+            else if(sscanf(msg, "del %lld %n", &job.when, &off) == 1 && off > 0){
+                strcpy(name, msg + off);
+                job.deleted = 1;
+            }
+            else if(strcmp(msg, "syn") == 0){
+                //Snapshot complete: drop local files the leader lacks
+                struct dirent *dir;
+                DIR *d = opendir(".");
+                while(d != NULL && (dir = readdir(d)) != NULL){
+                    struct stat st;
+                    if(dir->d_name[0] == '.' || stat(dir->d_name, &st) < 0 || !S_ISREG(st.st_mode))
+                        continue;
+                    for(i = 0; i < seenCount && strcmp(seen[i], dir->d_name) != 0; i++);
+                    if(i == seenCount) unlink(dir->d_name);
+                }
+                if(d != NULL) closedir(d);
+                for(i = 0; i < seenCount; i++) free(seen[i]);
+                seenCount = 0;
+                syncing = 0;
+                continue;
+            }
+            else continue;
+            if(!validName(name) || strlen(name) >= MAX_NAME) continue;
+            strcpy(job.name, name);
 
-    //While there are characters in the file
-    while(!feof(file)){
-        //Read from the file
-        int numBytesRead = fread(buffer, sizeof(char), 500, file);
-        //Send data chunks to client
-        int success = write(socketFD, buffer, numBytesRead);
-        if(success < 0)
-            error("ERROR writing message to socket.");
+            if(syncing && !job.deleted){
+                if(seenCount == seenCap){
+                    seenCap = seenCap ? seenCap * 2 : 64;
+                    seen = realloc(seen, seenCap * sizeof(*seen));
+                }
+                seen[seenCount++] = strdup(name);
+            }
+
+            //Skip files that already match the leader
+            struct stat st;
+            if(!job.deleted && stat(name, &st) == 0 && st.st_size == job.size
+                    && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec == job.mtime)
+                continue;
+
+            //A queued (not yet started) change to the same file is replaced
+            for(i = 0; i < count && !(jobs[i].pid == 0 && strcmp(jobs[i].name, name) == 0); i++);
+            if(i < count){
+                job.when = jobs[i].when;
+                jobs[i] = job;
+                continue;
+            }
+            if(count == cap){
+                cap = cap ? cap * 2 : 64;
+                jobs = realloc(jobs, cap * sizeof(*jobs));
+            }
+            jobs[count++] = job;
+        }
+
+        printf("Lost leader, reconnecting.\n");
+        metrics->replConnected = 0;
+        close(streamFD);
+        for(i = 0; i < seenCount; i++) free(seen[i]);
+        seenCount = 0;
+        sleep(1);
     }
-    //Close file
-    fclose(file);
-    //Free buffer
-    free(buffer);
+}
+
+
+
+/*********************************************************************
+ * ** Function: openAccessLog()
+ * ** Description: Opens (or creates) the binary access log for
+ *      appending, writing the file header if the log is new.
+ * ** Parameters: The log's path.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: accessLogFD is open, or the program exits.
+ * *********************************************************************/
+void openAccessLog(const char *path){
+    accessLogFD = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(accessLogFD < 0) error("ERROR opening access log");
+    if(lseek(accessLogFD, 0, SEEK_END) == 0
+            && write(accessLogFD, ACCESS_LOG_MAGIC, 8) != 8)
+        error("ERROR writing access log");
+}
+
+
+
+/*********************************************************************
+ * ** Function: logAccess()
+ * ** Description: Appends one request to the access log (see
+ *      ftlog.h), in a single write so records from different server
+ *      processes never interleave.
+ * ** Parameters: The client's address, the command to log, the
+ *      command with its root and deadline prefixes taken off (which
+ *      picks the record's kind), the wall-clock and monotonic times
+ *      the request was accepted, the file bytes sent for it.
+ * ** Pre-Conditions: None; does nothing unless -L was given.
+ * ** Post-Conditions: The record is appended.
+ * *********************************************************************/
+void logAccess(struct sockaddr_in *cliAddr, const char *cmd, const char *bare,
+        long long startWall, long long startUsec, long long bytes){
+    char record[sizeof(struct accessRecord) + BUFFER_SIZE];
+    struct accessRecord *rec = (struct accessRecord *) record;
+
+    if(accessLogFD < 0) return;
+    rec->timeUsec = startWall / 1000;
+    rec->bytes = bytes;
+    rec->latencyUsec = nowUsec() - startUsec;
+    rec->client = cliAddr->sin_addr.s_addr;
+    rec->nameLen = strnlen(cmd, BUFFER_SIZE);
+    if(strncmp(bare, "+bulk ", 6) == 0) bare += 6;
+    rec->command = strncmp(bare, "-l", 2) == 0 ? ACCESS_LIST
+        : bare[0] == '-' ? ACCESS_OTHER : ACCESS_GET;
+    rec->reserved = 0;
+    memcpy(record + sizeof(*rec), cmd, rec->nameLen);
+    if(write(accessLogFD, record, sizeof(*rec) + rec->nameLen) < 0)
+        perror("ERROR writing access log");
 }
 
 
@@ -296,18 +3471,95 @@ void sendFile(char *fileName, int socketFD, int portNum){
  *      messages or data between server and client, a command or
  *      file name must be loaded in the buffer for parsing.
  * ** Post-Conditions: The server will send its directory listing,
- *      the file specified, or an error msg (file not found -OR-
- *      command unknown).
+ *      the file specified, the result of a server-side file
+ *      operation, or an error msg (file not found -OR- command
+ *      unknown).
  * *********************************************************************/
 void handleRequest(char *buffer, int socketFD, int portNum){
+    //In relay mode, listings and files come from the upstream
+    if(upstreamHost != NULL && strncmp(buffer, "-l", 2) == 0){
+        relayDir(socketFD, portNum);
+        return;
+    }
+    if(upstreamHost != NULL && buffer[0] != '-' && strncmp(buffer, "\%none", 5) != 0){
+        relayFile(buffer, socketFD, portNum);
+        return;
+    }
     //If command is -l
     if(strncmp(buffer, "-l", 2) == 0){
         //Send current directory listing across
         printf("List directory requested on port %i.\n", portNum);
-        sendMsg(socketFD, buffer, "dir\n");
+        sendMsg(socketFD, "dir\n");
         sendDir(socketFD, portNum);
         return;
     }
+    //If command is a server-side copy, move or concatenate
+    if(strncmp(buffer, "-cp ", 4) == 0 || strncmp(buffer, "-mv ", 4) == 0
+            || strncmp(buffer, "-cat ", 5) == 0){
+        handleFileOp(buffer, socketFD, portNum);
+        return;
+    }
+    //If command asks for a file's size, mtime and hash
+    if(strncmp(buffer, "-s ", 3) == 0){
+        sendStat(buffer, socketFD, portNum);
+        return;
+    }
+    //If command asks for many files' metadata at once
+    if(strncmp(buffer, "-stats", 6) == 0){
+        sendStats(socketFD, portNum);
+        return;
+    }
+    //If command asks for the largest or newest files
+    if(strncmp(buffer, "-top ", 5) == 0 || strncmp(buffer, "-range ", 7) == 0){
+        sendQuery(buffer, socketFD, portNum);
+        return;
+    }
+    //If command asks for part of a file, from an offset on
+    if(strncmp(buffer, "-r ", 3) == 0){
+        sendRange(buffer, socketFD, portNum);
+        return;
+    }
+    //If command is a follower subscribing to changes, stream them
+    //from a separate process so other clients are still served
+    if(strncmp(buffer, "-watch", 6) == 0){
+        pid_t pid = fork();
+        if(pid == 0){
+            //The stream process blocks on its own, outside any event loop
+            closeInherited(socketFD);
+            fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) & ~O_NONBLOCK);
+            currentCo = NULL;
+            streamChanges(socketFD, portNum);
+            exit(0);
+        }
+        if(pid < 0){
+            perror("ERROR starting change stream");
+            sendMsg(socketFD, "err\n");
+        }
+        return;
+    }
+    //If command asks for generated data or to discard an upload
+    if(strncmp(buffer, "-probe ", 7) == 0){
+        sendProbe(buffer, socketFD, portNum);
+        return;
+    }
+    if(strncmp(buffer, "-sink", 5) == 0){
+        recvSink(socketFD, portNum);
+        return;
+    }
+    //If command asks for the server's counters
+    if(strncmp(buffer, "-metrics", 8) == 0){
+        sendMetrics(socketFD, portNum);
+        return;
+    }
+    //If command is one half of a server-to-server transfer
+    if(strncmp(buffer, "-rcv ", 5) == 0){
+        recvPush(buffer, socketFD, portNum);
+        return;
+    }
+    if(strncmp(buffer, "-push ", 6) == 0){
+        pushFile(buffer, socketFD, portNum);
+        return;
+    }
     //If command is !'%none', indicating that a filename
     //was entered by the client on the command-line
     if(strncmp(buffer, "\%none", 5) != 0){
@@ -318,33 +3570,841 @@ void handleRequest(char *buffer, int socketFD, int portNum){
             char *fileName = malloc(BUFFER_SIZE);
             strcpy(fileName, buffer);
             //If valid, send file transfer intent
-            sendMsg(socketFD, buffer, "fil\n");
+            sendFileIntent(socketFD, fileName, 0);
             //Send file across
-            sendFile(fileName, socketFD, portNum);
+            sendFile(fileName, 0, socketFD, portNum);
             free(fileName);
         }
         //Else send error message: file not found
         else {
             printf("File not found. Sending error message to client: %i.\n", portNum);
-            sendMsg(socketFD, buffer, "nof\n");
+            sendMsg(socketFD, "nof\n");
         }
         return;
     }
     //Else send error message: command unknown
     else
-        sendMsg(socketFD, buffer, "unk\n");
+        sendMsg(socketFD, "unk\n");
     return;
 }
 
 
+/*********************************************************************
+ * ** Function: setBusyPoll()
+ * ** Description: Turns on kernel busy polling for a socket:
+ *      SO_BUSY_POLL for busyPollUsec, SO_PREFER_BUSY_POLL, and
+ *      SO_BUSY_POLL_BUDGET if a budget was given. Raising the poll
+ *      time above net.core.busy_read needs CAP_NET_ADMIN; a failure
+ *      is reported once and the server carries on without it.
+ * ** Parameters: The socket file descriptor.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The options are set where the kernel allows.
+ * *********************************************************************/
+void setBusyPoll(int socketFD){
+    static int warned = 0;
+    int on = 1;
+
+    if(busyPollUsec == 0) return;
+    if((setsockopt(socketFD, SOL_SOCKET, SO_BUSY_POLL, &busyPollUsec, sizeof(busyPollUsec)) < 0
+            || setsockopt(socketFD, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0
+            || (busyPollBudget > 0 && setsockopt(socketFD, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                    &busyPollBudget, sizeof(busyPollBudget)) < 0)) && !warned){
+        perror("Kernel busy polling unavailable");
+        warned = 1;
+    }
+}
+
+
+
+/*********************************************************************
+ * ** Function: spinForClient()
+ * ** Description: In busy-poll mode, waits for a connection to accept
+ *      by polling the listener without sleeping for up to
+ *      busyPollUsec, then falls back to a blocking poll(). This
+ *      trades a core for not paying the wakeup latency on every
+ *      request that arrives while spinning.
+ * ** Parameters: The listening socket's file descriptor.
+ * ** Pre-Conditions: busyPollUsec > 0.
+ * ** Post-Conditions: Returns when the listener is readable or a
+ *      signal arrived.
+ * *********************************************************************/
+void spinForClient(int listenFD){
+    struct pollfd pfd = { listenFD, POLLIN, 0 };
+    long long deadline = nowUsec() + busyPollUsec;
+
+    while(!stopping && nowUsec() < deadline)
+        if(poll(&pfd, 1, 0) > 0) return;
+    if(!stopping) poll(&pfd, 1, -1);
+}
+
+
+
+/*********************************************************************
+ * ** Function: stopServer()
+ * ** Description: Signal handler for SIGINT and SIGTERM. Lets the
+ *      accept loop finish so the server exits through main(), which
+ *      also writes out profiles in instrumented (PGO) builds.
+ * ** Parameters: The signal number.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: stopping is set.
+ * *********************************************************************/
+void stopServer(int sig){
+    (void) sig;
+    stopping = 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: findRoot()
+ * ** Description: Reads the "/name " prefix that directs a command to
+ *      a root other than the default one.
+ * ** Parameters: The address of the command, which is moved past
+ *      the prefix.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: Returns the root (the default one if there's no
+ *      prefix), or NULL if the name isn't a root.
+ * *********************************************************************/
+struct servedRoot *findRoot(char **command){
+    char *name = *command + 1, *end;
+    int i;
+
+    if(**command != '/') return &roots[0];
+    end = strchr(name, ' ');
+    if(end == NULL) end = name + strlen(name);
+    for(i = 0; i < numRoots; i++){
+        if((int) strlen(roots[i].name) == end - name && strncmp(roots[i].name, name, end - name) == 0){
+            *command = *end == ' ' ? end + 1 : end;
+            return &roots[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+/*********************************************************************
+ * ** Function: addRoot()
+ * ** Description: Sets up a root from its -R argument,
+ *      name:path[:quota[:maxEntries]]. The name "default" configures
+ *      the root the server would otherwise serve from the current
+ *      directory.
+ * ** Parameters: The argument.
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: The root is ready to serve, or the server exits
+ *      with an error.
+ * *********************************************************************/
+void addRoot(char *arg){
+    char *name = strtok(arg, ":"), *path = strtok(NULL, ":");
+    char *quota = strtok(NULL, ":"), *maxEntries = strtok(NULL, ":");
+    struct servedRoot *root;
+    int i;
+
+    if(name == NULL || path == NULL || !validName(name) || strlen(name) >= ROOT_NAME)
+        error("ERROR, -R takes name:path[:quota[:maxEntries]]");
+    for(i = 0; i < numRoots && strcmp(roots[i].name, name) != 0; i++);
+    if(i == MAX_ROOTS) error("ERROR, too many roots");
+    root = &roots[i];
+    if(i == numRoots){
+        numRoots++;
+        strcpy(root->name, name);
+        root->dirFD = -1;
+        root->index.watchFD = -1;
+    }
+    if(root->dirFD >= 0) close(root->dirFD);
+    root->dirFD = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(root->dirFD < 0) error("ERROR opening root directory");
+    root->quota = quota != NULL ? atoi(quota) : 0;
+    root->index.maxEntries = maxEntries != NULL ? atol(maxEntries) : 0;
+    printf("Serving \"%s\" as root %s", path, name);
+    if(root->quota > 0) printf(", %d requests at a time", root->quota);
+    if(root->index.maxEntries > 0) printf(", indexing up to %ld entries", root->index.maxEntries);
+    printf(".\n");
+}
+
+
+
+/*********************************************************************
+ * ** Function: serveInRoot()
+ * ** Description: Handles a request in its root, unless the root is
+ *      already serving its quota of requests, which answers "bsy".
+ * ** Parameters: The root, the command, the data connection's socket
+ *      file descriptor, the data port number.
+ * ** Pre-Conditions: The process is in the root (see selectRoot()).
+ * ** Post-Conditions: The request is handled or refused.
+ * *********************************************************************/
+void serveInRoot(struct servedRoot *root, char *command, int dataSockFD, int dataPort){
+    long long *active = &metrics->rootActive[root - roots];
+
+    if(__atomic_add_fetch(active, 1, __ATOMIC_RELAXED) > root->quota && root->quota > 0){
+        __atomic_add_fetch(&metrics->rootRefused[root - roots], 1, __ATOMIC_RELAXED);
+        printf("Root \"%s\" is at its quota, refusing request.\n", root->name);
+        sendMsg(dataSockFD, "bsy\n");
+    }
+    else
+        handleRequest(command, dataSockFD, dataPort);
+    __atomic_sub_fetch(active, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/*********************************************************************
+ * ** Function: parseDeadline()
+ * ** Description: Takes a deadline prefix off a command and sets
+ *      requestDeadline from it: "@ms " is a wall-clock time in
+ *      milliseconds since the epoch, so time spent queued before the
+ *      server read the command counts, and "@+ms " is that many
+ *      milliseconds after it arrived.
+ * ** Parameters: The address of the command, which is moved past
+ *      the prefix, and when the command arrived (nowUsec() time).
+ * ** Pre-Conditions: None
+ * ** Post-Conditions: requestDeadline is set, or 0 with no prefix.
+ * *********************************************************************/
+void parseDeadline(char **command, long long arrivedUsec){
+    char *cmd = *command, *end;
+    long long ms;
+
+    requestDeadline = 0;
+    if(cmd[0] != '@')
+        return;
+    ms = strtoll(cmd + 1 + (cmd[1] == '+'), &end, 10);
+    if(end == cmd + 1 + (cmd[1] == '+') || *end != ' ')
+        return;
+    *command = end + 1;
+    if(cmd[1] == '+')
+        requestDeadline = arrivedUsec + ms * 1000;
+    else
+        requestDeadline = nowUsec() + ms * 1000 - wallNsec() / 1000;
+    //0 and -1 mean something else, and neither can be met anyway
+    if(requestDeadline == 0 || requestDeadline == -1)
+        requestDeadline = 1;
+}
+
+
+
+/*********************************************************************
+ * ** Function: requestClass()
+ * ** Description: Picks a request's traffic class. A "+bulk " prefix
+ *      from the client makes it bulk (and is removed). Otherwise,
+ *      with classes on (-b), file and range transfers and probes of
+ *      at least bulkThreshold bytes, uploads ("-sink", "-rcv") and
+ *      pushes are bulk; everything else is interactive. File sizes
+ *      come from the root's index.
+ * ** Parameters: The address of the command, which is moved past
+ *      any hint.
+ * ** Pre-Conditions: The process is in the request's root.
+ * ** Post-Conditions: Returns CLASS_INTERACTIVE or CLASS_BULK.
+ * *********************************************************************/
+int requestClass(char **command){
+    char *cmd = *command, *name = cmd;
+    long long offset = 0;
+    struct dirEntry e;
+
+    if(strncmp(cmd, "+bulk ", 6) == 0){
+        *command = cmd + 6;
+        return CLASS_BULK;
+    }
+    if(bulkSlots == 0) return CLASS_INTERACTIVE;
+    if(strncmp(cmd, "-sink", 5) == 0 || strncmp(cmd, "-rcv ", 5) == 0 || strncmp(cmd, "-push ", 6) == 0)
+        return CLASS_BULK;
+    if(strncmp(cmd, "-probe ", 7) == 0)
+        return parseSize(cmd + 7) >= bulkThreshold ? CLASS_BULK : CLASS_INTERACTIVE;
+    if(strncmp(cmd, "-r ", 3) == 0 && (name = strchr(cmd + 3, ' ')) != NULL){
+        offset = atoll(cmd + 3);
+        name++;
+    }
+    else if(cmd[0] == '-')
+        return CLASS_INTERACTIVE;
+    if(indexStat(&cwdRoot->index, name, &e) == 0 && e.size - offset >= bulkThreshold)
+        return CLASS_BULK;
+    return CLASS_INTERACTIVE;
+}
+
+
+
+/*********************************************************************
+ * ** Function: bulkAcquire()
+ * ** Description: Waits for a bulk slot. In event-driven mode the
+ *      coroutine queues for one of this process's slots and is
+ *      scheduled as bulk until it's done; otherwise the process
+ *      waits on the slots shared by all server processes. Either
+ *      wait ends at the request's deadline, if it has one, and a
+ *      process's wait also ends when the server stops.
+ * ** Parameters: None
+ * ** Pre-Conditions: bulkSlots > 0.
+ * ** Post-Conditions: Returns 0 with a slot held, which
+ *      bulkRelease() returns, or -1 if the deadline passed or the
+ *      server stopped first.
+ * *********************************************************************/
+int bulkAcquire(){
+    __atomic_add_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+    if((requestDeadline != 0 && nowUsec() > requestDeadline) || (stopping && currentCo == NULL)){
+        __atomic_sub_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(currentCo != NULL){
+        currentCo->cls = CLASS_BULK;
+        currentCo->unyielded = 0;
+        if(bulkFree > 0)
+            bulkFree--;
+        else {
+            //bulkRelease() hands its slot straight to the first waiter
+            currentCo->next = NULL;
+            if(bulkWaitTail) bulkWaitTail->next = currentCo;
+            else bulkWaitHead = currentCo;
+            bulkWaitTail = currentCo;
+            swapcontext(&currentCo->ctx, &schedulerCtx);
+            if(currentCo->expired){
+                currentCo->expired = 0;
+                currentCo->cls = CLASS_INTERACTIVE;
+                __atomic_sub_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+                return -1;
+            }
+        }
+    }
+    else if(requestDeadline != 0){
+        long long wall = wallNsec() + (requestDeadline - nowUsec()) * 1000;
+        struct timespec until = { wall / 1000000000, wall % 1000000000 };
+        int waited;
+        while((waited = sem_timedwait(&metrics->bulkSem, &until)) < 0 && errno == EINTR && !stopping);
+        if(waited < 0){
+            __atomic_sub_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    else {
+        int waited;
+        while((waited = sem_wait(&metrics->bulkSem)) < 0 && errno == EINTR && !stopping);
+        if(waited < 0){
+            __atomic_sub_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    __atomic_sub_fetch(&metrics->bulkWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->bulkActive, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: bulkExpire()
+ * ** Description: Drops coroutines whose deadline has passed from the
+ *      event-driven bulk queue and wakes them, so their bulkAcquire()
+ *      fails instead of waiting on for a slot.
+ * ** Parameters: None
+ * ** Pre-Conditions: Called from the scheduler.
+ * ** Post-Conditions: Returns the milliseconds until the next waiter's
+ *      deadline, or -1 if none has one.
+ * *********************************************************************/
+int bulkExpire(){
+    struct coroutine **link = &bulkWaitHead, *co;
+    long long now = nowUsec(), next = -1;
+
+    bulkWaitTail = NULL;
+    while((co = *link) != NULL){
+        if(co->deadline != 0 && (co->deadline < 0 || co->deadline <= now)){
+            *link = co->next;
+            co->expired = 1;
+            coQueue(co);
+            continue;
+        }
+        if(co->deadline > 0 && (next < 0 || co->deadline < next))
+            next = co->deadline;
+        bulkWaitTail = co;
+        link = &co->next;
+    }
+    return next < 0 ? -1 : (next - now + 999) / 1000;
+}
+
+
+
+/*********************************************************************
+ * ** Function: bulkRelease()
+ * ** Description: Returns a bulk slot, to the first coroutine waiting
+ *      for one if there is any.
+ * ** Parameters: None
+ * ** Pre-Conditions: The caller holds a slot from bulkAcquire().
+ * ** Post-Conditions: The slot is free or handed on, and the caller
+ *      is interactive again.
+ * *********************************************************************/
+void bulkRelease(){
+    __atomic_sub_fetch(&metrics->bulkActive, 1, __ATOMIC_RELAXED);
+    if(currentCo != NULL){
+        currentCo->cls = CLASS_INTERACTIVE;
+        if(bulkWaitHead != NULL){
+            struct coroutine *co = bulkWaitHead;
+            bulkWaitHead = co->next;
+            if(bulkWaitHead == NULL) bulkWaitTail = NULL;
+            coQueue(co);
+        }
+        else
+            bulkFree++;
+    }
+    else
+        sem_post(&metrics->bulkSem);
+}
+
+
+
+/*********************************************************************
+ * ** Function: timedExpire()
+ * ** Description: Wakes coroutines whose time limit or deadline
+ *      passed while they waited on a socket in coWaitUntil(),
+ *      disarming the socket, so the read, write or accept they were
+ *      in fails with ETIMEDOUT instead of waiting for a peer that may
+ *      never come.
+ * ** Parameters: None
+ * ** Pre-Conditions: Called from the scheduler.
+ * ** Post-Conditions: Returns the milliseconds until the next timed
+ *      waiter's deadline, or -1 if there is none.
+ * *********************************************************************/
+int timedExpire(){
+    struct coroutine *co, *next;
+    long long now = nowUsec(), soonest = -1;
+
+    for(co = timedHead; co != NULL; co = next){
+        next = co->timedNext;
+        if(co->waitUntil <= now){
+            epoll_ctl(epollFD, EPOLL_CTL_DEL, co->waitFD, NULL);
+            coQueue(co);
+        }
+        else if(soonest < 0 || co->waitUntil < soonest)
+            soonest = co->waitUntil;
+    }
+    return soonest < 0 ? -1 : (soonest - now + 999) / 1000;
+}
+
+
+
+/*********************************************************************
+ * ** Function: serveRequest()
+ * ** Description: Takes a command and data port from the control
+ *      connection, connects back to the data port, handles the
+ *      request and logs it. The command is handed to handleRequest()
+ *      where it sits in the reader, after any "/root " prefix picks
+ *      the directory it runs in; an unknown root answers "nof". With
+ *      traffic classes, bulk requests wait for a bulk slot, in a
+ *      forked process unless in event-driven mode. A request with an
+ *      "@" deadline that passes before it starts, or while it waits
+ *      for a slot, answers "exp"; one already under way is cut off.
+ *      While it runs, the control connection is watched for
+ *      "-cancel", which stops it and closes the data connection; a
+ *      cancel that arrives after the request is done is ignored, as
+ *      is one sent behind more pipelined commands than the reader
+ *      holds once their padding is squeezed out. A
+ *      forked bulk process takes the control connection over for
+ *      this unless more commands are already waiting on it. Anything
+ *      that goes wrong after the two messages arrive only fails
+ *      this request.
+ * ** Parameters: The client's address, the control connection's
+ *      file descriptor, the connection's reader.
+ * ** Pre-Conditions: The client has been accepted.
+ * ** Post-Conditions: The request is served and the data connection
+ *      closed. Returns 0, or -1 if the control connection ended, was
+ *      handed to a bulk process or sent something that isn't a
+ *      request.
+ * *********************************************************************/
+int serveRequest(struct sockaddr_in *cliAddr, int controlFD, struct cmdReader *reader){
+    long long startWall = wallNsec(), startUsec = nowUsec();
+    char *command, *dataPortStr;
+    int dataSockFD;
+
+    //Get command and data port from the client on the control
+    //connection
+    readerCompact(reader);
+    if((command = nextMessage(reader, controlFD)) == NULL)
+        return -1;
+    if(strcmp(command, "-cancel") == 0){
+        printf("Cancel received with no transfer running.\n");
+        return 0;
+    }
+    if((dataPortStr = nextMessage(reader, controlFD)) == NULL)
+        return -1;
+    int dataPort = atoi(dataPortStr);
+    //The log keeps the root, a deadline relative to arrival so a
+    //replay can still meet it, and the command itself
+    char logged[BUFFER_SIZE], *cmdStart = command;
+    long long arrived = nowUsec();
+    struct servedRoot *root = findRoot(&command);
+    int loggedLen = snprintf(logged, sizeof(logged), "%.*s", (int) (command - cmdStart), cmdStart);
+    parseDeadline(&command, arrived);
+    if(requestDeadline != 0)
+        loggedLen += snprintf(logged + loggedLen, sizeof(logged) - loggedLen, "@+%lld ",
+                (requestDeadline - arrived) / 1000);
+    snprintf(logged + loggedLen, sizeof(logged) - loggedLen, "%s", command);
+
+    //Establish data connection. Clients listen before they send the
+    //port, so there's no need to wait for them first.
+    dataSockFD = socket(AF_INET, SOCK_STREAM | (eventMode ? SOCK_NONBLOCK : 0), 0);
+    if(dataSockFD < 0){
+        perror("ERROR opening socket");
+        return 0;
+    }
+    setBusyPoll(dataSockFD);
+    cliAddr->sin_port = htons(dataPort);
+    if(ioConnect(dataSockFD, (struct sockaddr*) cliAddr, sizeof(*cliAddr)) < 0){
+        perror("ERROR establishing data connection");
+        close(dataSockFD);
+        return 0;
+    }
+
+    //Handle request on data connection, inside its root and traffic
+    //class. Bulk requests in the blocking modes go to a process of
+    //their own, which waits for a bulk slot while this one carries on.
+    long long sentBefore = bytesSentHere;
+    pid_t pid = -1;
+    watch.controlFD = controlFD;
+    watch.dataFD = dataSockFD;
+    watch.reader = reader;
+    watch.unchecked = watch.cancelled = 0;
+    __atomic_add_fetch(&metrics->requests, 1, __ATOMIC_RELAXED);
+    if(root == NULL || selectRoot(root) < 0)
+        sendMsg(dataSockFD, "nof\n");
+    else if(requestDeadline != 0 && nowUsec() > requestDeadline){
+        printf("Request expired before it started.\n");
+        __atomic_add_fetch(&metrics->expiredQueued, 1, __ATOMIC_RELAXED);
+        requestDeadline = 0; //Let the answer itself through
+        sendMsg(dataSockFD, "exp\n");
+    }
+    else {
+        int cls = requestClass(&command);
+        int forkBulk = cls == CLASS_BULK && bulkSlots > 0 && !eventMode;
+        __atomic_add_fetch(&metrics->classRequests[cls], 1, __ATOMIC_RELAXED);
+        //A burst of bulk requests past the queue is refused rather
+        //than becoming as many waiting processes
+        int refused = forkBulk && __atomic_add_fetch(&metrics->bulkProcesses, 1, __ATOMIC_RELAXED)
+            > bulkSlots + BULK_QUEUE;
+        if(refused) __atomic_sub_fetch(&metrics->bulkProcesses, 1, __ATOMIC_RELAXED);
+        else if(forkBulk){
+            int handOver = !moreCommands(reader, controlFD);
+            pid_t parent = getpid();
+            fflush(stdout);
+            if((pid = fork()) > 0){
+                close(dataSockFD);
+                watch.controlFD = watch.dataFD = -1;
+                return handOver ? -1 : 0;
+            }
+            if(pid == 0){
+                //Neither hold the port nor keep waiting once the
+                //server is gone
+                close(serverListenFD);
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if(getppid() != parent) stopping = 1;
+                if(!handOver){
+                    close(controlFD);
+                    watch.controlFD = -1;
+                }
+            }
+            else {
+                perror("ERROR starting bulk process");
+                __atomic_sub_fetch(&metrics->bulkProcesses, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if(refused){
+            printf("Bulk queue is full, refusing request.\n");
+            sendMsg(dataSockFD, "bsy\n");
+        }
+        else if(cls == CLASS_BULK && bulkSlots > 0 && bulkAcquire() < 0){
+            if(stopping){
+                printf("Server stopping, dropping queued bulk request.\n");
+                sendMsg(dataSockFD, "bsy\n");
+            }
+            else {
+                printf("Request expired waiting for a bulk slot.\n");
+                __atomic_add_fetch(&metrics->expiredQueued, 1, __ATOMIC_RELAXED);
+                requestDeadline = 0;
+                sendMsg(dataSockFD, "exp\n");
+            }
+        }
+        else {
+            //A bulk request may have been cancelled while it queued
+            if(cls != CLASS_BULK || bulkSlots == 0 || !cancelRequested())
+                serveInRoot(root, command, dataSockFD, dataPort);
+            if(cls == CLASS_BULK && bulkSlots > 0) bulkRelease();
+            if(requestDeadline == -1){
+                printf("Request cut off by its deadline.\n");
+                __atomic_add_fetch(&metrics->expiredAborted, 1, __ATOMIC_RELAXED);
+            }
+            if(watch.cancelled){
+                printf("Request cancelled by the client.\n");
+                __atomic_add_fetch(&metrics->cancelled, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    requestDeadline = 0;
+    watch.controlFD = watch.dataFD = -1;
+    watch.cancelled = 0;
+
+    //Close data connection socket
+    printf("Closing data connection.\n");
+    printf("\n\n");
+    close(dataSockFD);
+    logAccess(cliAddr, logged, command, startWall, startUsec, bytesSentHere - sentBefore);
+    if(pid == 0){
+        __atomic_sub_fetch(&metrics->bulkProcesses, 1, __ATOMIC_RELAXED);
+        exit(0);
+    }
+    return 0;
+}
+
+
+
+/*********************************************************************
+ * ** Function: serveClient()
+ * ** Description: Serves requests from one control connection until
+ *      it ends. Clients may pipeline, sending several commands (each
+ *      followed by its data port) without waiting; they're answered
+ *      in order, one data connection each.
+ * ** Parameters: The client's address, the control connection's
+ *      file descriptor.
+ * ** Pre-Conditions: The client has just been accepted.
+ * ** Post-Conditions: The client's requests are served. The control
+ *      connection is left for the caller to close.
+ * *********************************************************************/
+void serveClient(struct sockaddr_in *cliAddr, int controlFD){
+    struct cmdReader *reader = malloc(sizeof(*reader));
+
+    if(reader == NULL){
+        perror("ERROR allocating command reader");
+        return;
+    }
+    reader->head = reader->scan = reader->tail = 0;
+    while(serveRequest(cliAddr, controlFD, reader) == 0 && moreCommands(reader, controlFD));
+    free(reader);
+}
+
+
+
+/*********************************************************************
+ * ** Function: noteIncomingCPU()
+ * ** Description: Compares the CPU that received a connection's
+ *      packets (SO_INCOMING_CPU) with the one about to serve it, and
+ *      counts the connection as a cross-CPU handoff if they differ.
+ * ** Parameters: The accepted connection's file descriptor.
+ * ** Pre-Conditions: initMetrics() must have run.
+ * ** Post-Conditions: The accepts and crossCPUAccepts metrics are
+ *      updated, unless the kernel doesn't report the CPU.
+ * *********************************************************************/
+void noteIncomingCPU(int socketFD){
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if(getsockopt(socketFD, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0)
+        return;
+    __atomic_add_fetch(&metrics->accepts, 1, __ATOMIC_RELAXED);
+    if(cpu != sched_getcpu())
+        __atomic_add_fetch(&metrics->crossCPUAccepts, 1, __ATOMIC_RELAXED);
+}
+
+
+
+//One client connection in event-driven mode
+struct session {
+    int controlFD;
+    struct sockaddr_in cliAddr;
+};
+
+
+/*********************************************************************
+ * ** Function: serveSession()
+ * ** Description: Coroutine body for one client in event-driven mode:
+ *      the same steps as the blocking accept loop, except that the
+ *      session waits on an idle control connection for more
+ *      commands.
+ * ** Parameters: The session, malloc'd by runEventLoop().
+ * ** Pre-Conditions: Runs as a coroutine.
+ * ** Post-Conditions: The requests are served, the control connection
+ *      closed and the session freed.
+ * *********************************************************************/
+void serveSession(void *arg){
+    struct session *sess = arg;
+
+    printf("Connection from client.\n");
+    noteIncomingCPU(sess->controlFD);
+    setBusyPoll(sess->controlFD);
+    serveClient(&sess->cliAddr, sess->controlFD);
+    close(sess->controlFD);
+    free(sess);
+    liveSessions--;
+}
+
+
+
+/*********************************************************************
+ * ** Function: runEventLoop()
+ * ** Description: The event-driven server: accepts every pending
+ *      connection when the listener is readable, starts a coroutine
+ *      for each, and queues coroutines to resume, by traffic class,
+ *      as their sockets become ready. Peer connections for relay and
+ *      push requests wait here too. Disk reads and file locks still
+ *      block, so a session reading a cold file holds up the rest for
+ *      that long, as does the name lookup for a peer.
+ * ** Parameters: The listening socket's file descriptor.
+ * ** Pre-Conditions: The listener is bound and listening.
+ * ** Post-Conditions: Returns once the server is stopping.
+ * *********************************************************************/
+void runEventLoop(int listenFD){
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct rlimit lim;
+    int i, n;
+
+    //Tens of thousands of sessions need as many descriptors
+    if(getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max){
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFD < 0) error("ERROR creating epoll instance");
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, listenFD, &ev) < 0)
+        error("ERROR watching listener");
+
+    while(!stopping){
+        //Run everything that's ready before sleeping, interactive
+        //sessions first. Those that yield wait for the next pass, so
+        //new events are picked up in between.
+        int ready = runCount, timeout, timed;
+        struct coroutine *co;
+        while(ready-- > 0 && (co = coNext()) != NULL)
+            coResume(co);
+        timeout = bulkExpire();
+        timed = timedExpire();
+        if(timed >= 0 && (timeout < 0 || timed < timeout)) timeout = timed;
+
+        //In busy-poll mode, spin before blocking
+        n = epoll_wait(epollFD, events, MAX_EVENTS, 0);
+        if(n == 0 && busyPollUsec > 0){
+            long long deadline = nowUsec() + busyPollUsec;
+            while(n == 0 && !stopping && nowUsec() < deadline)
+                n = epoll_wait(epollFD, events, MAX_EVENTS, 0);
+        }
+        //Wake for the next waiter's deadline, if nothing sooner
+        if(n == 0 && runCount == 0) n = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+        if(n < 0){
+            if(errno != EINTR) perror("ERROR waiting for events");
+            continue;
+        }
+
+        for(i = 0; i < n; i++){
+            if(events[i].data.ptr != NULL){
+                coQueue(events[i].data.ptr);
+                continue;
+            }
+            //Listener: take every waiting connection
+            while(1){
+                struct session *sess = malloc(sizeof(*sess));
+                socklen_t len = sizeof(sess->cliAddr);
+                sess->controlFD = accept4(listenFD, (struct sockaddr *) &sess->cliAddr,
+                        &len, SOCK_NONBLOCK);
+                if(sess->controlFD < 0){
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        perror("ERROR on accept");
+                    free(sess);
+                    break;
+                }
+                if(coSpawn(serveSession, sess) < 0){
+                    perror("ERROR starting session");
+                    close(sess->controlFD);
+                    free(sess);
+                    continue;
+                }
+                liveSessions++;
+            }
+        }
+    }
+    close(epollFD);
+}
+
+
+
+/*********************************************************************
+ * ** Function: startWorkers()
+ * ** Description: Opens one SO_REUSEPORT listener per worker and forks
+ *      the workers. The listeners are all bound before any fork so
+ *      their order in the reuseport group is their worker number.
+ *      With steering, a classic BPF program on the group picks the
+ *      listener numbered after the CPU that received the connection,
+ *      modulo the number of workers, and each worker is pinned to the
+ *      CPUs that map to it. The parent process only waits for a stop
+ *      signal and passes it on.
+ * ** Parameters: The port number, the server's sockaddr_in struct.
+ * ** Pre-Conditions: workers > 1, and with steering no more workers
+ *      than CPUs.
+ * ** Post-Conditions: In a worker, returns its listener. In the
+ *      parent, returns -1 once every worker has exited.
+ * *********************************************************************/
+int startWorkers(int portNum, struct sockaddr_in *servAddr){
+    int fds[MAX_WORKERS];
+    pid_t pids[MAX_WORKERS];
+    int i, j, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for(i = 0; i < workers; i++){
+        createSocket(&fds[i]);
+        startUp(portNum, servAddr, fds[i]);
+    }
+    if(steerCPU){
+        //A = CPU the packet arrived on; return A % workers
+        struct sock_filter code[] = {
+            { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+        if(setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+            error("ERROR attaching reuseport program");
+    }
+
+    //Keep the children from repeating buffered output
+    fflush(stdout);
+    for(i = 0; i < workers; i++){
+        pids[i] = fork();
+        if(pids[i] < 0) error("ERROR forking worker");
+        if(pids[i] == 0){
+            for(j = 0; j < workers; j++)
+                if(j != i) close(fds[j]);
+            if(steerCPU){
+                //The same CPUs the program sends to this worker
+                cpu_set_t set;
+                int c;
+                CPU_ZERO(&set);
+                for(c = i; c < cpus; c += workers)
+                    CPU_SET(c, &set);
+                if(sched_setaffinity(0, sizeof(set), &set) < 0)
+                    perror("ERROR pinning worker");
+            }
+            return fds[i];
+        }
+    }
+
+    //The workers own the listeners now
+    for(i = 0; i < workers; i++) close(fds[i]);
+    printf("Started %i workers%s.\n", workers, steerCPU ? ", steered by CPU" : "");
+    //Signals are only let in while suspended, so none is lost
+    //between the check and the wait
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    while(!stopping) sigsuspend(&old);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    for(i = 0; i < workers; i++) kill(pids[i], SIGTERM);
+    for(i = 0; i < workers; i++) waitpid(pids[i], NULL, 0);
+    return -1;
+}
+
+
+
 /*MAIN*/
 int main(int argc, char *argv[]){
     //Variable, file descriptors, and Struct definitions
-    int listenSockFD, connectSockFD, dataSockFD;
+    int listenSockFD, connectSockFD;
     int portNum;
     struct sockaddr_in *servAddr = malloc(sizeof(struct sockaddr_in));
     struct sockaddr_in *cliAddr = malloc(sizeof(struct sockaddr_in)); //From <netinet/in.h>
-    char *buffer = malloc(BUFFER_SIZE); //For storing characters exchanged in socket connection
 
     //command-line parameter validation
     if(argc < 2){
@@ -362,48 +4422,164 @@ int main(int argc, char *argv[]){
     //Convert specified portNum to int
     portNum = atoi(argv[1]);
 
-    //Create a new socket
-    createSocket(&listenSockFD);
+    //Optional settings follow the port number
+    int opt;
+    optind = 2;
+    while((opt = getopt(argc, argv, "u:C:M:f:j:L:w:SB:ER:b:")) != -1){
+        switch(opt){
+            case 'u': //Relay for the upstream ftserver at host:port
+                upstreamHost = optarg;
+                upstreamPort = strrchr(optarg, ':');
+                if(upstreamPort == NULL) error("ERROR, -u takes host:port");
+                *upstreamPort++ = '\0';
+                break;
+            case 'C': //Relay cache directory
+                cacheDir = optarg;
+                break;
+            case 'M': //Relay cache size limit
+                cacheMax = parseSize(optarg);
+                break;
+            case 'f': //Replicate the leader ftserver at host:port
+                leaderHost = optarg;
+                leaderPort = strrchr(optarg, ':');
+                if(leaderPort == NULL) error("ERROR, -f takes host:port");
+                *leaderPort++ = '\0';
+                break;
+            case 'j': //Parallel fetches while following
+                followJobs = atoi(optarg);
+                if(followJobs < 1 || followJobs > MAX_FOLLOW_JOBS)
+                    error("ERROR, -j out of range");
+                break;
+            case 'L': //Binary access log
+                openAccessLog(optarg);
+                break;
+            case 'w': //Worker processes
+                workers = atoi(optarg);
+                if(workers < 1 || workers > MAX_WORKERS)
+                    error("ERROR, -w out of range");
+                break;
+            case 'S': //Steer connections to the worker on their CPU
+                steerCPU = 1;
+                break;
+            case 'E': //Event-driven: coroutine per connection
+                eventMode = 1;
+                break;
+            case 'R': //Another served directory, or the default's settings
+                addRoot(optarg);
+                break;
+            case 'b': //Bulk slots, optionally with the bulk size threshold
+                bulkSlots = atoi(optarg);
+                if(strchr(optarg, ',') != NULL)
+                    bulkThreshold = parseSize(strchr(optarg, ',') + 1);
+                if(bulkSlots < 1 || bulkThreshold <= 0)
+                    error("ERROR, -b takes slots[,size]");
+                break;
+            case 'B': //Busy-poll for usec, optionally with a budget
+                busyPollUsec = atoi(optarg);
+                if(strchr(optarg, ',') != NULL)
+                    busyPollBudget = atoi(strchr(optarg, ',') + 1);
+                if(busyPollUsec < 1 || busyPollBudget < 0)
+                    error("ERROR, -B takes usec[,budget]");
+                break;
+            default:
+                printf("usage: ./executableName portNum [-u host:port [-C cacheDir] [-M maxBytes]]"
+                        " [-f host:port [-j jobs]] [-L accessLog] [-w workers [-S]]"
+                        " [-B usec[,budget]] [-E] [-R name:path[:quota[:maxEntries]]]..."
+                        " [-b slots[,size]].\n");
+                exit(1);
+        }
+    }
+    if(steerCPU && workers < 2) error("ERROR, -S needs -w 2 or more");
+    if(steerCPU && workers > sysconf(_SC_NPROCESSORS_ONLN))
+        error("ERROR, -S needs no more workers than CPUs");
+    if(upstreamHost != NULL){
+        //The upstream is asked for its default root only, so other
+        //roots would be served the wrong files
+        if(numRoots > 1) error("ERROR, -R roots other than default can't be relayed");
+        //Absolute, so the cache is found from whichever root a
+        //request runs in
+        static char cachePath[PATH_MAX];
+        if(mkdir(cacheDir, 0755) < 0 && errno != EEXIST)
+            error("ERROR creating cache directory");
+        if(realpath(cacheDir, cachePath) == NULL) error("ERROR resolving cache directory");
+        if(strlen(cachePath) > (size_t) BUFFER_SIZE - 220) error("ERROR, cache directory path too long");
+        cacheDir = cachePath;
+        printf("Relaying for %s:%s, caching up to %lld bytes in %s.\n",
+                upstreamHost, upstreamPort, cacheMax, cacheDir);
+    }
 
-    //Start up server to listen
-    startUp(portNum, servAddr, listenSockFD);
+    //Everything else (relay cache, replication) also lives in the
+    //default root
+    if(roots[0].dirFD < 0 && (roots[0].dirFD = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        error("ERROR opening current directory");
+    if(fchdir(roots[0].dirFD) < 0) error("ERROR entering default root");
 
-    //Until SIGINT is received, accept connections
-    while(1){
-        //Accept client connection
-        acceptClient(cliAddr, &connectSockFD, listenSockFD);
+    //Change streams run in their own processes; nobody waits for them
+    initMetrics();
+    if(bulkSlots > 0){
+        if(sem_init(&metrics->bulkSem, 1, bulkSlots) < 0) error("ERROR creating bulk slots");
+        bulkFree = bulkSlots;
+        printf("Bulk requests (%lld bytes and up) run %d at a time.\n", bulkThreshold, bulkSlots);
+    }
+    fflush(stdout); //So forked processes don't repeat startup messages
+    signal(SIGCHLD, SIG_IGN);
+    //A client that disconnects mid-transfer is a failed write, not a crash
+    signal(SIGPIPE, SIG_IGN);
+    //Stop without SA_RESTART so a blocked accept() returns
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stopServer;
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    if(leaderHost != NULL && fork() == 0){
+        followLeader();
+        exit(0);
+    }
 
-        //Get command and other info from the client
-        //on the control connection
-        recMsg(buffer, connectSockFD);
+    if(workers > 1){
+        //Each worker continues below with its own listener
+        listenSockFD = startWorkers(portNum, servAddr);
+        if(listenSockFD < 0){
+            free(servAddr);
+            return 0;
+        }
+    }
+    else {
+        //Create a new socket
+        createSocket(&listenSockFD);
 
-        //Get data port for data connection
-        char *dataPortStr = malloc(BUFFER_SIZE);
-        recMsg(dataPortStr, connectSockFD);
-        int dataPort = atoi(dataPortStr);
+        //Start up server to listen
+        startUp(portNum, servAddr, listenSockFD);
+    }
 
-        //Establish data connection
-        sleep(1);
-        createSocket(&dataSockFD);
+    setBusyPoll(listenSockFD);
+    serverListenFD = listenSockFD;
+    if(eventMode) runEventLoop(listenSockFD);
 
-        cliAddr->sin_port = htons(dataPort);
-        if(connect(dataSockFD, (struct sockaddr*) cliAddr, sizeof(*cliAddr)) < 0)
-            error("ERROR establishing data connection.\n");
+    //Until SIGINT is received, accept connections
+    while(!stopping){
+        if(busyPollUsec > 0){
+            spinForClient(listenSockFD);
+            if(stopping) break;
+        }
 
-        //Handle request on data connection
-        handleRequest(buffer, dataSockFD, dataPort);
+        //Accept client connection; if we're out of file descriptors,
+        //give other connections a moment to close
+        if(acceptClient(cliAddr, &connectSockFD, listenSockFD) < 0){
+            if(!stopping) usleep(10000);
+            continue;
+        }
 
-        //Close data connection socket
-        printf("Closing data connection.\n");
-        printf("\n\n");
-        close(dataSockFD);
-        //Free dataPort Str
-        free(dataPortStr);
+        //Serve its requests, then close the control connection
+        noteIncomingCPU(connectSockFD);
+        setBusyPoll(connectSockFD);
+        serveClient(cliAddr, connectSockFD);
+        close(connectSockFD);
     }
 
     //Close control socket and free memory
+    printf("Shutting down.\n");
     close(listenSockFD);
     free(servAddr);
-    free(buffer);
     return 0;
 }